@@ -1,14 +1,24 @@
 struct buf;
 struct context;
+struct cpustat;
+struct memstat;
 struct file;
+struct image;
 struct inode;
+struct kmem_cache;
+struct ksmrange;
+struct ksmstat;
 struct pipe;
 struct proc;
+struct shm;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct swapstat;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -24,6 +34,7 @@ void            panic(char*) __attribute__((noreturn));
 
 // exec.c
 int             exec(char*, char**);
+int             loadimage(char*, char**, struct image*);
 
 // file.c
 struct file*    filealloc(void);
@@ -40,7 +51,8 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
-void            iinit(int dev);
+void            iinit(void);
+void            fsinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -65,13 +77,31 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_pages(int);
+char*           kalloc_zeroed(void);
 void            kfree(char*);
+void            kfree_pages(char*, int);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kdup(char*);
+int             krefs(char*);
+extern uint     phystop;
+extern uint     kpages;
+void            kallocstat(int, struct cpustat*);
+int             kzeroidle(void);
 
 // kbd.c
 void            kbdintr(void);
 
+// ksm.c
+int             ksmactive(void);
+void            ksminit(void);
+int             ksmpages(struct proc*, uint*, int*, int);
+void            ksmpass(void);
+int             madvise(uint, uint, int);
+void            ksmset(struct ksmrange*, struct ksmrange*);
+void            ksmstat(struct ksmstat*);
+
 // lapic.c
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
@@ -95,12 +125,27 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint, uint);
+char*           pcshared(struct inode*, uint);
+void            pcdrop(struct inode*);
+int             pcreclaim(void);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, uint);
+int             shmat(int);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+
 // proc.c
 int             cpuid(void);
 void            exit(void);
@@ -115,11 +160,34 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             spawn(char*, char**, int*, int);
+char*           evict(pte_t);
+void            ksmscan(void);
+struct proc*    ksmproc(int, struct proc*, int*);
+void            mlfqboost(void);
+void            schedtick(void);
+int             setpriority(int, int);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 
+// swap.c
+void            swapinit(int);
+uint            swapsize(void);
+int             swapout(void);
+void            swapin(pte_t, char*);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+void            swapstat(struct swapstat*);
+
+// zram.c
+void            zraminit(void);
+char*           zput(char*, uint*, int*);
+void            zget(char*, uint, char*);
+void            zfree(char*, uint);
+void            zramstat(struct swapstat*);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -132,6 +200,11 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -150,13 +223,17 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argptrw(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
 
 // timer.c
-void            timerinit(void);
+void            timeradd(struct timer*, uint, void (*)(void*), void*);
+int             timerdel(struct timer*);
+int             timerpending(struct timer*);
+void            timertick(uint);
 
 // trap.c
 void            idtinit(void);
@@ -178,11 +255,27 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, struct vma*);
 void            switchuvm(struct proc*);
+void            resumeuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
+int             pagefault(uint, uint);
+int             faultin(uint, uint, int);
+int             uvmvalid(struct proc*, uint, uint);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+struct vma*     findvma(struct vma*, uint);
+pte_t*          clockscan(struct proc*, uint*);
+extern uint     clockscanned;
+int             mmap(struct file*, uint, int, int, uint);
+int             munmap(uint, uint);
+int             mapshm(struct shm*);
+int             unmapshm(uint);
+void            vmadup(struct vma*, struct vma*);
+void            vmaclear(struct vma*);
+void            vmaflush(pde_t*, struct vma*);
+void            vmatrim(struct vma*, uint);
+void            uvmstat(pde_t*, uint, struct memstat*);
 void            clearpteu(pde_t *pgdir, char *uva);
 
 // number of elements in fixed-size array
@@ -2,22 +2,31 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
 
+// Build a new address space for the program at path, with argv
+// on its stack, for exec() or spawn().  The calling process is
+// left untouched.
+//
+// The program's segments are not read here.  Each becomes a
+// region in im->vma[], and pagefault() maps a page of the file,
+// shared with other processes running the program, or zero-fills
+// it for .bss, when it is first touched.
 int
-exec(char *path, char **argv)
+loadimage(char *path, char **argv, struct image *im)
 {
 	char *s, *last;
-	int i, off;
+	int i, off, nvma;
 	uint argc, sz, sp, ustack[3+MAXARG+1];
 	struct elfhdr elf;
 	struct inode *ip;
 	struct proghdr ph;
-	pde_t *pgdir, *oldpgdir;
-	struct proc *curproc = myproc();
+	struct vma *vma;
+	pde_t *pgdir;
 
 	begin_op();
 
@@ -28,6 +37,8 @@ exec(char *path, char **argv)
 	}
 	ilock(ip);
 	pgdir = 0;
+	vma = im->vma;
+	memset(vma, 0, sizeof(im->vma));
 
 	// Check ELF header
 	if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -38,8 +49,9 @@ exec(char *path, char **argv)
 	if((pgdir = setupkvm()) == 0)
 		goto bad;
 
-	// Load program into memory.
+	// Map program segments.
 	sz = 0;
+	nvma = 0;
 	for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
 		if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
 			goto bad;
@@ -49,12 +61,20 @@ exec(char *path, char **argv)
 			goto bad;
 		if(ph.vaddr + ph.memsz < ph.vaddr)
 			goto bad;
-		if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+		if(ph.vaddr + ph.memsz >= KERNBASE)
 			goto bad;
-		if(ph.vaddr % PGSIZE != 0)
+		if(ph.vaddr % PGSIZE != 0 || ph.vaddr < sz)
 			goto bad;
-		if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+		if(nvma == NVMA)
 			goto bad;
+		vma[nvma].start = ph.vaddr;
+		vma[nvma].end = PGROUNDUP(ph.vaddr + ph.memsz);
+		vma[nvma].ip = idup(ip);
+		vma[nvma].off = ph.off;
+		vma[nvma].filesz = ph.filesz;
+		vma[nvma].flags = (ph.flags & ELF_PROG_FLAG_WRITE) ? VMA_WRITE : 0;
+		nvma++;
+		sz = ph.vaddr + ph.memsz;
 	}
 	iunlockput(ip);
 	end_op();
@@ -91,24 +111,50 @@ exec(char *path, char **argv)
 	for(last=s=path; *s; s++)
 		if(*s == '/')
 			last = s+1;
-	safestrcpy(curproc->name, last, sizeof(curproc->name));
+	safestrcpy(im->name, last, sizeof(im->name));
 
-	// Commit to the user image.
-	oldpgdir = curproc->pgdir;
-	curproc->pgdir = pgdir;
-	curproc->sz = sz;
-	curproc->tf->eip = elf.entry;  // main
-	curproc->tf->esp = sp;
-	switchuvm(curproc);
-	freevm(oldpgdir);
+	im->pgdir = pgdir;
+	im->sz = sz;
+	im->entry = elf.entry;
+	im->sp = sp;
 	return 0;
 
 	bad:
 	if(pgdir)
 		freevm(pgdir);
-	if(ip){
+	if(ip)
 		iunlockput(ip);
-		end_op();
-	}
+	else
+		begin_op();
+	vmaclear(vma);
+	end_op();
 	return -1;
 }
+
+int
+exec(char *path, char **argv)
+{
+	struct image im;
+	pde_t *oldpgdir;
+	struct proc *curproc = myproc();
+
+	if(loadimage(path, argv, &im) < 0)
+		return -1;
+
+	// Commit to the user image.
+	safestrcpy(curproc->name, im.name, sizeof(curproc->name));
+	oldpgdir = curproc->pgdir;
+	curproc->pgdir = im.pgdir;
+	curproc->sz = im.sz;
+	curproc->tf->eip = im.entry;  // main
+	curproc->tf->esp = im.sp;
+	switchuvm(curproc);
+	vmaflush(oldpgdir, curproc->vma);
+	freevm(oldpgdir);
+	begin_op();
+	vmaclear(curproc->vma);
+	end_op();
+	memmove(curproc->vma, im.vma, sizeof(im.vma));
+	ksmset(curproc->ksm, 0);
+	return 0;
+}
@@ -2,3 +2,13 @@
 #define O_WRONLY  0x001
 #define O_RDWR    0x002
 #define O_CREATE  0x200
+
+// mmap() protection and flags
+#define PROT_READ    0x1
+#define PROT_WRITE   0x2
+#define MAP_SHARED   0x1  // write changes back to the file
+#define MAP_PRIVATE  0x2  // keep changes to this process
+
+// madvise() advice
+#define MADV_MERGEABLE    1  // merge identical pages (see ksm.c)
+#define MADV_UNMERGEABLE  2  // stop merging them
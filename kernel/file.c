@@ -11,15 +11,19 @@
 #include "file.h"
 
 struct devsw devsw[NDEV];
+
+// File structures are allocated from ftable.cache on demand;
+// ftable.lock protects their reference counts.
 struct {
 	struct spinlock lock;
-	struct file file[NFILE];
+	struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
 	initlock(&ftable.lock, "ftable");
+	ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -28,16 +32,11 @@ filealloc(void)
 {
 	struct file *f;
 
-	acquire(&ftable.lock);
-	for(f = ftable.file; f < ftable.file + NFILE; f++){
-		if(f->ref == 0){
-			f->ref = 1;
-			release(&ftable.lock);
-			return f;
-		}
-	}
-	release(&ftable.lock);
-	return 0;
+	if((f = kmem_cache_alloc(ftable.cache)) == 0)
+		return 0;
+	memset(f, 0, sizeof(*f));
+	f->ref = 1;
+	return f;
 }
 
 // Increment ref count for file f.
@@ -66,9 +65,8 @@ fileclose(struct file *f)
 		return;
 	}
 	ff = *f;
-	f->ref = 0;
-	f->type = FD_NONE;
 	release(&ftable.lock);
+	kmem_cache_free(ftable.cache, f);
 
 	if(ff.type == FD_PIPE)
 		pipeclose(ff.pipe, ff.writable);
@@ -14,8 +14,10 @@ struct inode {
 	uint dev;           // Device number
 	uint inum;          // Inode number
 	int ref;            // Reference count
+	struct inode *next; // Next in icache.list
 	struct sleeplock lock; // protects everything below here
 	int valid;          // inode has been read from disk?
+	int pcached;        // may have pages in pcache.c
 
 	short type;         // copy of disk inode
 	short major;
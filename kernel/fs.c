@@ -14,8 +14,8 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -119,18 +119,20 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to a cache entry (open files and
+//   current directories). iget() finds or creates a cache
+//   entry and increments its ref; iput() decrements ref.
+//   Entries are allocated from icache.cache, so the number
+//   of active inodes is limited only by memory. Up to
+//   NICACHE entries whose ref has fallen to zero stay
+//   cached for the next iget(); after that, the one
+//   released longest ago is freed.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -154,30 +156,35 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The icache.lock spin-lock protects icache.list, icache.nidle
+// and the allocation of icache entries. Since ip->ref indicates
+// whether an entry is in use, and ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold
+// icache.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum and next.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
 	struct spinlock lock;
-	struct inode inode[NINODE];
+	struct inode *list;       // most recently released first
+	struct kmem_cache *cache;
+	int nidle;                // entries with ref zero
 } icache;
 
 void
-iinit(int dev)
+iinit(void)
 {
-	int i = 0;
-
 	initlock(&icache.lock, "icache");
-	for(i = 0; i < NINODE; i++) {
-		initsleeplock(&icache.inode[i].lock, "inode");
-	}
+	icache.cache = kmem_cache_create("inode", sizeof(struct inode));
+}
 
+// Read the super block of the root device.
+// Must run in process context, since it sleeps on disk I/O.
+void
+fsinit(int dev)
+{
 	readsb(dev, &sb);
 	cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -189,7 +196,8 @@ static struct inode* iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there is no memory for it.
 struct inode*
 ialloc(uint dev, short type)
 {
@@ -197,15 +205,21 @@ ialloc(uint dev, short type)
 	struct buf *bp;
 	struct dinode *dip;
 
+	struct inode *ip;
+
 	for(inum = 1; inum < sb.ninodes; inum++){
 		bp = bread(dev, IBLOCK(inum, sb));
 		dip = (struct dinode*)bp->data + inum%IPB;
 		if(dip->type == 0){  // a free inode
+			if((ip = iget(dev, inum)) == 0){
+				brelse(bp);
+				return 0;
+			}
 			memset(dip, 0, sizeof(*dip));
 			dip->type = type;
 			log_write(bp);   // mark it allocated on the disk
 			brelse(bp);
-			return iget(dev, inum);
+			return ip;
 		}
 		brelse(bp);
 	}
@@ -237,34 +251,37 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if there is no memory for a new entry.
 static struct inode*
 iget(uint dev, uint inum)
 {
-	struct inode *ip, *empty;
+	struct inode *ip;
 
 	acquire(&icache.lock);
 
 	// Is the inode already cached?
-	empty = 0;
-	for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-		if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-			ip->ref++;
+	for(ip = icache.list; ip; ip = ip->next){
+		if(ip->dev == dev && ip->inum == inum){
+			if(ip->ref++ == 0)
+				icache.nidle--;
 			release(&icache.lock);
 			return ip;
 		}
-		if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-			empty = ip;
 	}
 
-	// Recycle an inode cache entry.
-	if(empty == 0)
-		panic("iget: no inodes");
-
-	ip = empty;
+	// Allocate a new inode cache entry.
+	if((ip = kmem_cache_alloc(icache.cache)) == 0){
+		release(&icache.lock);
+		return 0;
+	}
+	memset(ip, 0, sizeof(*ip));
+	initsleeplock(&ip->lock, "inode");
 	ip->dev = dev;
 	ip->inum = inum;
 	ip->ref = 1;
 	ip->valid = 0;
+	ip->next = icache.list;
+	icache.list = ip;
 	release(&icache.lock);
 
 	return ip;
@@ -305,6 +322,7 @@ ilock(struct inode *ip)
 		memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
 		brelse(bp);
 		ip->valid = 1;
+		ip->pcached = 1;  // from before it was last in memory
 		if(ip->type == 0)
 			panic("ilock: no type");
 	}
@@ -321,8 +339,9 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry
+// stays cached, unless it is no longer valid or too many
+// others are; then an entry is freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -330,6 +349,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+	struct inode **pp, **victim;
+
 	acquiresleep(&ip->lock);
 	if(ip->valid && ip->nlink == 0){
 		acquire(&icache.lock);
@@ -346,8 +367,32 @@ iput(struct inode *ip)
 	releasesleep(&ip->lock);
 
 	acquire(&icache.lock);
-	ip->ref--;
+	if(--ip->ref > 0){
+		release(&icache.lock);
+		return;
+	}
+	for(pp = &icache.list; *pp != ip; pp = &(*pp)->next)
+		;
+	*pp = ip->next;
+	if(ip->valid){
+		// Keep it, at the front of the list, and free the
+		// idle entry furthest back if there are too many.
+		ip->next = icache.list;
+		icache.list = ip;
+		if(++icache.nidle <= NICACHE){
+			release(&icache.lock);
+			return;
+		}
+		victim = 0;
+		for(pp = &icache.list; *pp; pp = &(*pp)->next)
+			if((*pp)->ref == 0)
+				victim = pp;
+		ip = *victim;
+		*victim = ip->next;
+		icache.nidle--;
+	}
 	release(&icache.lock);
+	kmem_cache_free(icache.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -430,6 +475,7 @@ itrunc(struct inode *ip)
 
 	ip->size = 0;
 	iupdate(ip);
+	pcdrop(ip);
 }
 
 // Copy stat information from inode.
@@ -503,6 +549,8 @@ writei(struct inode *ip, char *src, uint off, uint n)
 		ip->size = off;
 		iupdate(ip);
 	}
+	if(n > 0)
+		pcdrop(ip);
 	return n;
 }
 
@@ -515,11 +563,12 @@ namecmp(const char *s, const char *t)
 }
 
 // Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// If found, set *poff to byte offset of entry
+// and return its inode number; else return 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
 {
-	uint off, inum;
+	uint off;
 	struct dirent de;
 
 	if(dp->type != T_DIR)
@@ -534,27 +583,37 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 			// entry matches path element
 			if(poff)
 				*poff = off;
-			inum = de.inum;
-			return iget(dp->dev, inum);
+			return de.inum;
 		}
 	}
 
 	return 0;
 }
 
+// Look for a directory entry in a directory, and return
+// its inode.  If found, set *poff to byte offset of entry.
+// Returns 0 if not found, or if there is no memory for
+// the inode.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+	uint inum;
+
+	if((inum = dirfind(dp, name, poff)) == 0)
+		return 0;
+	return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
 	int off;
 	struct dirent de;
-	struct inode *ip;
 
 	// Check that name is not present.
-	if((ip = dirlookup(dp, name, 0)) != 0){
-		iput(ip);
+	if(dirfind(dp, name, 0) != 0)
 		return -1;
-	}
 
 	// Look for an empty dirent.
 	for(off = 0; off < dp->size; off += sizeof(de)){
@@ -620,9 +679,10 @@ namex(char *path, int nameiparent, char *name)
 {
 	struct inode *ip, *next;
 
-	if(*path == '/')
-		ip = iget(ROOTDEV, ROOTINO);
-	else
+	if(*path == '/'){
+		if((ip = iget(ROOTDEV, ROOTINO)) == 0)
+			return 0;
+	} else
 		ip = idup(myproc()->cwd);
 
 	while((path = skipelem(path, name)) != 0){
@@ -5,10 +5,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -75,7 +75,7 @@ idestart(struct buf *b)
 {
 	if(b == 0)
 		panic("idestart");
-	if(b->blockno >= FSSIZE)
+	if(b->blockno >= FSSIZE + SWAPSIZE)
 		panic("incorrect blockno");
 	int sector_per_block =  BSIZE/SECTOR_SIZE;
 	int sector = b->blockno * sector_per_block;
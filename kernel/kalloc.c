@@ -1,6 +1,43 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, and physically
+// contiguous blocks of 2^order pages.
+//
+// Free memory is kept by a binary buddy allocator: a free
+// block of 2^order pages starts at a page number that is a
+// multiple of 2^order and sits on kmem.free[order].  Freeing
+// a block merges it with its buddy (the block whose page
+// number differs only in bit order) for as long as the buddy
+// is free too.  pages[] records, for the first page of each
+// free block, that it is free and its order.
+//
+// Memory handed over by kinit1()/kinit2() is not put on the
+// buddy lists up front.  It stays on kmem.untouched, a short
+// list of page ranges, and buddyalloc() carves aligned blocks
+// off the front of it only when the buddy lists run dry, so
+// boot does not touch every page of physical memory.
+//
+// The amount of memory comes from the BIOS memory map that
+// bootasm.S leaves at E820MAP; only ranges the BIOS reports as
+// usable RAM are handed to the allocator.
+//
+// Each CPU keeps a small cache of free single pages, so the
+// common kalloc()/kfree() pair does not touch the shared
+// kmem.lock.  An empty cache is refilled from the buddy lists
+// in batches of KCACHE_BATCH pages; if no memory is left there,
+// the CPU steals half of some other CPU's cache.  A cache that
+// grows beyond KCACHE_MAX pages drains a batch back.
+//
+// A user page shared copy-on-write by several address spaces
+// has a reference count in pages[]: the number of mappings
+// beyond the first.  kfree() of a shared page only drops a
+// reference.
+//
+// Idle CPUs zero free pages ahead of time into zpool, from
+// which kalloc_zeroed() serves page tables and user memory
+// without a memset on the allocating path.  Freed pages are
+// not scribbled over, so each page is written only once per
+// trip through the allocator.
 
 #include "types.h"
 #include "defs.h"
@@ -8,30 +45,125 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
+#include "kstat.h"
+
+#define KCACHE_ORDER 5
+#define KCACHE_BATCH (1 << KCACHE_ORDER)
+#define KCACHE_MAX   (2*KCACHE_BATCH)
+
+#define ZPOOL_MAX    256  // pre-zeroed pages kept by idle CPUs
+
+#define NRANGE 16  // untouched ranges of physical memory
+
+#define NE820  64  // most BIOS memory map entries looked at
+#define E820_RAM 1  // entry type of usable memory
 
 void freerange(void *vstart, void *vend);
+static void detectmem(void);
+static void addrange(uint pa, uint pend);
+static struct run *zpoolget(void);
 extern char end[]; // first address after kernel loaded from ELF file
 		   // defined by the kernel linker script in kernel.ld
 
+// A free page or block.  prev is only used on the buddy
+// lists, which are circular with a dummy head.
 struct run {
 	struct run *next;
+	struct run *prev;
+};
+
+// Physical page metadata, indexed by page number.
+#define PG_FREE 0x1  // first page of a block on a buddy list
+
+struct page {
+	uchar flags;
+	uchar order;  // order of the free block, if PG_FREE
+	ushort ref;   // extra references to an allocated page
+};
+
+struct page *pages;  // carved out of kinit1()'s memory
+uint npages;
+
+uint phystop;  // top of the physical memory the kernel uses
+uint kpages;   // pages given to the allocator
+
+// A BIOS memory map entry, as stored by bootasm.S.
+struct e820entry {
+	uint64 addr;
+	uint64 len;
+	uint type;
+} __attribute__((packed));
+
+// Copied out of low memory, which startothers() reuses.
+static struct e820entry e820[NE820];
+static int ne820;
+
+// A range of page numbers [start, end) not yet seen by the
+// buddy allocator.
+struct range {
+	uint start;
+	uint end;
 };
 
 struct {
 	struct spinlock lock;
 	int use_lock;
-	struct run *freelist;
+	struct run free[MAXORDER+1];
+	struct range untouched[NRANGE];
+	int nuntouched;
+	struct spinlock reflock;  // protects pages[].ref
 } kmem;
 
+// Per-CPU free page cache, indexed by cpuid().
+// The lock is only contended when another CPU steals.
+struct kcache {
+	struct spinlock lock;
+	struct run *freelist;
+	int nfree;
+	uint hit;     // kalloc() served from the cache
+	uint refill;  // batches taken from the buddy lists
+	uint steal;   // batches taken from another CPU's cache
+	uint drain;   // batches given back to the buddy lists
+	uint zhit;    // kalloc_zeroed() served from zpool
+	uint zmiss;   // kalloc_zeroed() had to zero a page itself
+	uint zfill;   // pages zeroed into zpool while idle
+} kcache[NCPU];
+
+struct {
+	struct spinlock lock;
+	struct run *list;
+	int n;
+} zpool;
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// The per-CPU caches are only used once kinit2() has run, since
+// mycpu() does not work before mpinit().
 void
 kinit1(void *vstart, void *vend)
 {
+	struct kcache *kc;
+	int i;
+
+	detectmem();
+	npages = phystop >> PGSHIFT;
+	pages = (struct page*)vstart;
+	vstart = pages + npages;
+	if(vstart >= vend)
+		panic("kinit1: no room for pages[]");
+	memset(pages, 0, npages * sizeof(struct page));
+
 	initlock(&kmem.lock, "kmem");
+	initlock(&kmem.reflock, "kref");
+	initlock(&zpool.lock, "zpool");
+	for(i = 0; i <= MAXORDER; i++)
+		kmem.free[i].next = kmem.free[i].prev = &kmem.free[i];
+	for(kc = kcache; kc < &kcache[NCPU]; kc++)
+		initlock(&kc->lock, "kcache");
 	kmem.use_lock = 0;
 	freerange(vstart, vend);
 }
@@ -43,37 +175,360 @@ kinit2(void *vstart, void *vend)
 	kmem.use_lock = 1;
 }
 
+// Set phystop from the BIOS memory map: the top of usable RAM,
+// limited to what fits in the kernel's direct map.  Without a
+// map (e.g. when booted by a multiboot loader) assume PHYSTOP.
+static void
+detectmem(void)
+{
+	uint *hdr;
+	struct e820entry *e;
+	uint64 top;
+
+	hdr = P2V(E820MAP);
+	ne820 = 0;
+	if(hdr[0] == E820MAGIC && (ushort)hdr[1] >= E820MAP+8)
+		ne820 = ((ushort)hdr[1] - (E820MAP+8)) / sizeof(struct e820entry);
+	if(ne820 > NE820)
+		ne820 = NE820;
+	memmove(e820, hdr + 2, ne820 * sizeof(struct e820entry));
+
+	top = 0;
+	for(e = e820; e < e820 + ne820; e++)
+		if(e->type == E820_RAM && e->addr + e->len > top)
+			top = e->addr + e->len;
+	if(top == 0)
+		top = PHYSTOP;
+	if(top > PHYSLIMIT)
+		top = PHYSLIMIT;
+	phystop = PGROUNDDOWN((uint)top);
+}
+
+// Give the pages in [vstart, vend) that the BIOS reports as
+// usable to the allocator.
 void
 freerange(void *vstart, void *vend)
 {
-	char *p;
-	p = (char*)PGROUNDUP((uint)vstart);
-	for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-		kfree(p);
+	struct e820entry *e;
+	uint64 start, end;
+
+	if(ne820 == 0){
+		addrange(V2P(vstart), V2P(vend));
+		return;
+	}
+	for(e = e820; e < e820 + ne820; e++){
+		if(e->type != E820_RAM)
+			continue;
+		start = e->addr > V2P(vstart) ? e->addr : V2P(vstart);
+		end = e->addr + e->len < V2P(vend) ? e->addr + e->len : V2P(vend);
+		if(start < end)
+			addrange(start, end);
+	}
+}
+
+// Record the physical pages in [pa, pend) as untouched.
+// They are only put on the buddy lists by carve().
+static void
+addrange(uint pa, uint pend)
+{
+	struct range *r;
+	uint start, end;
+
+	start = PGROUNDUP(pa) >> PGSHIFT;
+	end = PGROUNDDOWN(pend) >> PGSHIFT;
+	if(start >= end)
+		return;
+	if(kmem.use_lock)
+		acquire(&kmem.lock);
+	if(kmem.nuntouched == NRANGE)
+		panic("freerange: too many ranges");
+	r = &kmem.untouched[kmem.nuntouched++];
+	r->start = start;
+	r->end = end;
+	kpages += end - start;
+	if(kmem.use_lock)
+		release(&kmem.lock);
+}
+
+static void
+listpush(struct run *head, struct run *r)
+{
+	r->next = head->next;
+	r->prev = head;
+	head->next->prev = r;
+	head->next = r;
+}
+
+static void
+listremove(struct run *r)
+{
+	r->prev->next = r->next;
+	r->next->prev = r->prev;
+}
+
+// Put the block of 2^order pages at page number pn on the
+// buddy lists, merging it with free buddies.
+// Caller must hold kmem.lock.
+static void
+buddyfree(uint pn, int order)
+{
+	uint bpn;
+
+	while(order < MAXORDER){
+		bpn = pn ^ (1 << order);
+		if(bpn >= npages || !(pages[bpn].flags & PG_FREE) ||
+		   pages[bpn].order != order)
+			break;
+		listremove((struct run*)P2V(bpn << PGSHIFT));
+		pages[bpn].flags &= ~PG_FREE;
+		pn &= ~(1 << order);
+		order++;
+	}
+	pages[pn].flags |= PG_FREE;
+	pages[pn].order = order;
+	listpush(&kmem.free[order], (struct run*)P2V(pn << PGSHIFT));
+}
+
+// Move the largest aligned block at the front of the first
+// untouched range onto the buddy lists.  Only the block's first
+// page is written, to link it in.  Returns 0 if no untouched
+// memory is left.
+// Caller must hold kmem.lock.
+static int
+carve(void)
+{
+	struct range *r;
+	int order;
+
+	while(kmem.nuntouched > 0){
+		r = &kmem.untouched[0];
+		if(r->start < r->end)
+			break;
+		*r = kmem.untouched[--kmem.nuntouched];
+	}
+	if(kmem.nuntouched == 0)
+		return 0;
+
+	order = 0;
+	while(order < MAXORDER && r->start % (2 << order) == 0 &&
+	      r->start + (2 << order) <= r->end)
+		order++;
+	buddyfree(r->start, order);
+	r->start += 1 << order;
+	return 1;
+}
+
+// Take a block of 2^order pages off the buddy lists, splitting
+// a larger block if necessary.  Returns its page number,
+// or -1 if there is no block big enough.
+// Caller must hold kmem.lock.
+static int
+buddyalloc(int order)
+{
+	struct run *r;
+	uint pn;
+	int k;
+
+	for(;;){
+		for(k = order; k <= MAXORDER; k++)
+			if(kmem.free[k].next != &kmem.free[k])
+				break;
+		if(k <= MAXORDER)
+			break;
+		if(!carve())
+			return -1;
+	}
+
+	r = kmem.free[k].next;
+	listremove(r);
+	pn = V2P(r) >> PGSHIFT;
+	pages[pn].flags &= ~PG_FREE;
+	while(k > order){
+		k--;
+		pages[pn + (1 << k)].flags |= PG_FREE;
+		pages[pn + (1 << k)].order = k;
+		listpush(&kmem.free[k], (struct run*)P2V((pn + (1 << k)) << PGSHIFT));
+	}
+	return pn;
+}
+
+// Free the block of 2^order pages at v, which must have
+// been returned by kalloc_pages(order).
+void
+kfree_pages(char *v, int order)
+{
+	if(order < 0 || order > MAXORDER)
+		panic("kfree_pages: order");
+	if((uint)v % (PGSIZE << order) || v < end ||
+	   V2P(v) + (PGSIZE << order) > phystop)
+		panic("kfree_pages");
+	if(pages[V2P(v) >> PGSHIFT].flags & PG_FREE)
+		panic("kfree_pages: freeing free block");
+
+	if(kmem.use_lock)
+		acquire(&kmem.lock);
+	buddyfree(V2P(v) >> PGSHIFT, order);
+	if(kmem.use_lock)
+		release(&kmem.lock);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size.  Returns 0 if there is no such block.
+char*
+kalloc_pages(int order)
+{
+	int pn;
+
+	if(order == 0)
+		return kalloc();
+	if(order < 0 || order > MAXORDER)
+		return 0;
+
+	if(kmem.use_lock)
+		acquire(&kmem.lock);
+	pn = buddyalloc(order);
+	if(kmem.use_lock)
+		release(&kmem.lock);
+	if(pn < 0)
+		return 0;
+	return P2V(pn << PGSHIFT);
+}
+
+// Take up to max pages off kc's cache and return them as a list.
+// Caller must hold kc->lock.
+static struct run*
+kcachetake(struct kcache *kc, int max)
+{
+	struct run *r, *head;
+	int n;
+
+	head = 0;
+	for(n = 0; n < max && (r = kc->freelist) != 0; n++){
+		kc->freelist = r->next;
+		r->next = head;
+		head = r;
+		kc->nfree--;
+	}
+	return head;
+}
+
+// Refill kc, which was found empty, with a batch of pages from the
+// buddy lists or, failing that, with half of another CPU's cache.
+// Returns one of the pages for the caller, or 0 if no page is free
+// anywhere.  Must be called with interrupts off and no kcache lock
+// held; holding two kcache locks at once could deadlock two CPUs
+// stealing from each other.
+static struct run*
+krefill(struct kcache *kc)
+{
+	struct run *r, *head;
+	struct kcache *victim;
+	int n, pn;
+
+	// Prefer one contiguous batch, which costs a single
+	// buddy operation; fall back to scraping single pages.
+	head = 0;
+	acquire(&kmem.lock);
+	if((pn = buddyalloc(KCACHE_ORDER)) >= 0){
+		for(n = KCACHE_BATCH-1; n >= 0; n--){
+			r = (struct run*)P2V((pn + n) << PGSHIFT);
+			r->next = head;
+			head = r;
+		}
+	} else {
+		for(n = 0; n < KCACHE_BATCH && (pn = buddyalloc(0)) >= 0; n++){
+			r = (struct run*)P2V(pn << PGSHIFT);
+			r->next = head;
+			head = r;
+		}
+	}
+	release(&kmem.lock);
+
+	if(head)
+		kc->refill++;
+	else {
+		for(victim = kcache; victim < &kcache[ncpu] && head == 0; victim++){
+			if(victim == kc)
+				continue;
+			acquire(&victim->lock);
+			head = kcachetake(victim, (victim->nfree + 1) / 2);
+			release(&victim->lock);
+		}
+		if(head == 0)
+			return 0;
+		kc->steal++;
+	}
+
+	r = head;
+	head = head->next;
+	if(head){
+		acquire(&kc->lock);
+		while(head){
+			struct run *next = head->next;
+			head->next = kc->freelist;
+			kc->freelist = head;
+			kc->nfree++;
+			head = next;
+		}
+		release(&kc->lock);
+	}
+	return r;
 }
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(char *v)
 {
-	struct run *r;
+	struct run *r, *batch;
+	struct kcache *kc;
+	struct page *pg;
 
-	if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+	if(!kmem.use_lock){
+		kfree_pages(v, 0);
+		return;
+	}
+
+	if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
 		panic("kfree");
 
-	// Fill with junk to catch dangling refs.
-	memset(v, 1, PGSIZE);
+	// Only the holders of a page can add references to it, so
+	// a count of zero seen here cannot change under us.
+	pg = &pages[V2P(v) >> PGSHIFT];
+	if(pg->ref > 0){
+		acquire(&kmem.reflock);
+		if(pg->ref > 0){
+			pg->ref--;
+			release(&kmem.reflock);
+			return;
+		}
+		release(&kmem.reflock);
+	}
 
-	if(kmem.use_lock)
-		acquire(&kmem.lock);
 	r = (struct run*)v;
-	r->next = kmem.freelist;
-	kmem.freelist = r;
-	if(kmem.use_lock)
+	pushcli();
+	kc = &kcache[cpuid()];
+	acquire(&kc->lock);
+	r->next = kc->freelist;
+	kc->freelist = r;
+	kc->nfree++;
+	batch = 0;
+	if(kc->nfree > KCACHE_MAX)
+		batch = kcachetake(kc, KCACHE_BATCH);
+	release(&kc->lock);
+
+	if(batch){
+		kc->drain++;
+		acquire(&kmem.lock);
+		while(batch){
+			r = batch;
+			batch = r->next;
+			buddyfree(V2P(r) >> PGSHIFT, 0);
+		}
 		release(&kmem.lock);
+	}
+	popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +538,133 @@ char*
 kalloc(void)
 {
 	struct run *r;
+	struct kcache *kc;
+	int pn;
 
-	if(kmem.use_lock)
-		acquire(&kmem.lock);
-	r = kmem.freelist;
-	if(r)
-		kmem.freelist = r->next;
-	if(kmem.use_lock)
-		release(&kmem.lock);
+	if(!kmem.use_lock){
+		if((pn = buddyalloc(0)) < 0)
+			return 0;
+		return P2V(pn << PGSHIFT);
+	}
+
+	pushcli();
+	kc = &kcache[cpuid()];
+	acquire(&kc->lock);
+	r = kc->freelist;
+	if(r){
+		kc->freelist = r->next;
+		kc->nfree--;
+		kc->hit++;
+	}
+	release(&kc->lock);
+	if(r == 0)
+		r = krefill(kc);
+	popcli();
+	if(r == 0)
+		r = zpoolget();
 	return (char*)r;
 }
 
+// Take a page off the pre-zeroed pool, or return 0 if it is empty.
+// The link word is cleared, so the whole page is zero.
+static struct run*
+zpoolget(void)
+{
+	struct run *r;
+
+	acquire(&zpool.lock);
+	r = zpool.list;
+	if(r){
+		zpool.list = r->next;
+		zpool.n--;
+	}
+	release(&zpool.lock);
+	if(r)
+		r->next = 0;
+	return r;
+}
+
+// Allocate one zero-filled page.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_zeroed(void)
+{
+	char *v;
+
+	if(kmem.use_lock && (v = (char*)zpoolget()) != 0){
+		pushcli();
+		kcache[cpuid()].zhit++;
+		popcli();
+		return v;
+	}
+	if((v = kalloc()) == 0)
+		return 0;
+	memset(v, 0, PGSIZE);
+	if(kmem.use_lock){
+		pushcli();
+		kcache[cpuid()].zmiss++;
+		popcli();
+	}
+	return v;
+}
+
+// Called by an idle CPU's scheduler loop.  Zeroes one free
+// page into zpool and returns 1, or returns 0 if the pool
+// is full or memory is short, in which case the CPU should
+// halt instead.  Does nothing before kinit2(): other CPUs go
+// idle as soon as they start, while the free lists are still
+// being built without locks.
+int
+kzeroidle(void)
+{
+	char *v;
+
+	if(!kmem.use_lock || zpool.n >= ZPOOL_MAX || (v = kalloc()) == 0)
+		return 0;
+	memset(v, 0, PGSIZE);
+	acquire(&zpool.lock);
+	((struct run*)v)->next = zpool.list;
+	zpool.list = (struct run*)v;
+	zpool.n++;
+	kcache[cpuid()].zfill++;
+	release(&zpool.lock);
+	return 1;
+}
+
+// Add a reference to the allocated page at v, which
+// then takes one more kfree() to be freed.
+void
+kdup(char *v)
+{
+	if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
+		panic("kdup");
+	acquire(&kmem.reflock);
+	if(pages[V2P(v) >> PGSHIFT].ref == 0xFFFF)
+		panic("kdup: too many references");
+	pages[V2P(v) >> PGSHIFT].ref++;
+	release(&kmem.reflock);
+}
+
+// Return the number of references to the allocated page at v.
+int
+krefs(char *v)
+{
+	return pages[V2P(v) >> PGSHIFT].ref + 1;
+}
+
+// Report CPU cpu's free page cache counters.
+void
+kallocstat(int cpu, struct cpustat *st)
+{
+	struct kcache *kc;
+
+	kc = &kcache[cpu];
+	st->kalloc_hit = kc->hit;
+	st->kalloc_refill = kc->refill;
+	st->kalloc_steal = kc->steal;
+	st->kfree_drain = kc->drain;
+	st->kcache_pages = kc->nfree;
+	st->kzalloc_hit = kc->zhit;
+	st->kzalloc_miss = kc->zmiss;
+	st->kzero_fill = kc->zfill;
+}
@@ -0,0 +1,371 @@
+// Same-page merging.
+//
+// A process asks with madvise() for ranges of its memory to be
+// merged with identical pages, its own or other processes'.
+// Once a tick the scheduler calls ksmscan() (proc.c), which
+// hands ksmpages() the next few pages of those ranges.  Each
+// page is hashed and looked up in a table.  If the table holds
+// an identical merged page, the PTE is pointed at that instead,
+// read-only and copy-on-write if it was writable, and the page
+// is freed.  A write breaks the share again in cowbreak(), like
+// any other copy-on-write page.  Otherwise the page is noted as
+// a candidate, by process and address, and a later identical
+// page makes the candidate a merged page.
+//
+// The table holds a reference to each merged page, which it
+// drops at the end of a pass once no page table maps the page.
+// Candidates are forgotten at the end of each pass, so that a
+// page that keeps changing is not looked for again.  The table
+// is direct-mapped: a candidate that collides with another
+// entry replaces it, unless that entry is a merged page.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "kstat.h"
+
+#define NKSM  1024
+
+struct ksment {
+	uint sum;                 // hash of the page
+	char *page;               // merged page, or 0
+	int pid;                  // else the candidate's process, or 0
+	uint va;                  // and its address
+};
+
+struct {
+	struct spinlock lock;
+	struct ksment ent[NKSM];
+	uint nrange;              // ranges opted in, in all processes
+	uint seen;                // pages looked at this pass
+	uint scanned;
+	uint merged;
+	uint passes;
+} ksm;
+
+void
+ksminit(void)
+{
+	initlock(&ksm.lock, "ksm");
+}
+
+static uint
+pagesum(char *page)
+{
+	uint *w, h;
+
+	h = 2166136261U;
+	for(w = (uint*)page; w < (uint*)(page + PGSIZE); w++)
+		h = (h ^ *w) * 16777619U;
+	return h;
+}
+
+// The page at va of p that pte maps, if it may be merged, or 0.
+// A writable page only may if write is set; shared memory and
+// shared file mappings never may.
+static char*
+mergeable(struct proc *p, uint va, pte_t *pte, int write)
+{
+	struct vma *v;
+	char *page;
+
+	if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+		return 0;
+	page = P2V(PTE_ADDR(*pte));
+	if((*pte & PTE_W) && (!write || krefs(page) > 1))
+		return 0;
+	if((v = findvma(p->vma, va)) != 0 && (v->shm || (v->flags & VMA_SHARED)))
+		return 0;
+	return page;
+}
+
+// Point pte, of process p, at the merged page instead.
+static void
+share(struct proc *p, pte_t *pte, char *page)
+{
+	char *old;
+	int perm;
+
+	old = P2V(PTE_ADDR(*pte));
+	perm = PTE_P | PTE_U;
+	if(*pte & (PTE_W|PTE_COW))
+		perm |= PTE_COW;
+	kdup(page);
+	*pte = V2P(page) | perm;
+	p->lastcpu = 0;
+	kfree(old);
+	ksm.merged++;
+}
+
+// The lowest address at or above va in one of p's ranges,
+// or KERNBASE if there is none.
+static uint
+nextva(struct proc *p, uint va)
+{
+	struct ksmrange *r;
+	uint a;
+
+	a = KERNBASE;
+	for(r = p->ksm; r < &p->ksm[NKSMRANGE]; r++){
+		if(r->end <= va)
+			continue;
+		if(r->start <= va)
+			return va;
+		if(r->start < a)
+			a = r->start;
+	}
+	return a;
+}
+
+// Look up the page at va of p, and merge it if the table has
+// a copy.  Caller holds ksm.lock.
+static void
+ksmpage(struct proc *p, uint va, pte_t *pte, int write)
+{
+	struct ksment *e;
+	struct proc *q;
+	pte_t *qpte;
+	char *page, *c;
+	uint sum;
+	int qwrite;
+
+	if((page = mergeable(p, va, pte, write)) == 0)
+		return;
+	ksm.seen++;
+	ksm.scanned++;
+	sum = pagesum(page);
+	e = &ksm.ent[sum % NKSM];
+	if(e->page){
+		if(e->sum == sum && e->page != page && memcmp(e->page, page, PGSIZE) == 0)
+			share(p, pte, e->page);
+		return;
+	}
+	if(e->pid && e->sum == sum && (e->pid != p->pid || e->va != va) &&
+	   (q = ksmproc(e->pid, p, &qwrite)) != 0){
+		c = 0;
+		if(nextva(q, e->va) == e->va &&
+		   !(q->pgdir[PDX(e->va)] & PTE_PS) &&
+		   (qpte = walkpgdir(q->pgdir, (char*)e->va, 0)) != 0 &&
+		   (c = mergeable(q, e->va, qpte, qwrite)) != 0 &&
+		   (c == page || memcmp(c, page, PGSIZE) != 0))
+			c = 0;
+		if(c){
+			// The candidate becomes the merged page.
+			if(*qpte & PTE_W){
+				*qpte = (*qpte & ~PTE_W) | PTE_COW;
+				q->lastcpu = 0;
+			}
+			kdup(c);
+			e->page = c;
+			e->pid = 0;
+		}
+		if(q != p)
+			release(&q->lock);
+		if(c){
+			share(p, pte, c);
+			return;
+		}
+	}
+	e->sum = sum;
+	e->pid = p->pid;
+	e->va = va;
+}
+
+// Look at p's opted-in pages from *va on, counting each page
+// against *n, until *n runs out.  write says whether p's
+// writable pages may be made copy-on-write (see ksmproc()).
+// Returns 1 with *va where to go on if *n ran out first, or
+// 0 when done with p.  Caller holds ptable.lock and p->lock.
+int
+ksmpages(struct proc *p, uint *va, int *n, int write)
+{
+	pte_t *pte;
+	uint a;
+
+	acquire(&ksm.lock);
+	while((a = nextva(p, *va)) < KERNBASE){
+		if(*n <= 0){
+			*va = a;
+			release(&ksm.lock);
+			return 1;
+		}
+		(*n)--;
+		if((p->pgdir[PDX(a)] & PTE_PS) ||
+		   (pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0){
+			*va = PGADDR(PDX(a) + 1, 0, 0);
+			continue;
+		}
+		*va = a + PGSIZE;
+		ksmpage(p, a, pte, write);
+	}
+	release(&ksm.lock);
+	return 0;
+}
+
+// Called by ksmscan() after each pass over all processes:
+// free merged pages that are no longer mapped, and forget
+// the candidates.
+void
+ksmpass(void)
+{
+	struct ksment *e;
+
+	acquire(&ksm.lock);
+	if(ksm.seen > 0){
+		for(e = ksm.ent; e < &ksm.ent[NKSM]; e++){
+			if(e->page && krefs(e->page) == 1){
+				kfree(e->page);
+				e->page = 0;
+			}
+			e->pid = 0;
+		}
+		ksm.seen = 0;
+		ksm.passes++;
+	}
+	release(&ksm.lock);
+}
+
+// Remove [start, end) from the ranges rs.
+// Returns -1, changing nothing, if a range would have to be
+// split in two and there is no free slot.
+static int
+ksmclear(struct ksmrange *rs, uint start, uint end)
+{
+	struct ksmrange *r, *free;
+
+	free = 0;
+	for(r = rs; r < &rs[NKSMRANGE]; r++)
+		if(r->end == 0)
+			free = r;
+	for(r = rs; r < &rs[NKSMRANGE]; r++){
+		if(r->end <= start || r->start >= end)
+			continue;
+		if(r->start < start && r->end > end){
+			if(free == 0)
+				return -1;
+			free->start = end;
+			free->end = r->end;
+			r->end = start;
+		} else if(r->start < start)
+			r->end = start;
+		else if(r->end > end)
+			r->start = end;
+		else
+			r->start = r->end = 0;
+	}
+	return 0;
+}
+
+static int
+nranges(struct ksmrange *rs)
+{
+	struct ksmrange *r;
+	int n;
+
+	n = 0;
+	for(r = rs; r < &rs[NKSMRANGE]; r++)
+		if(r->end != 0)
+			n++;
+	return n;
+}
+
+// Replace the ranges rs of a process with a copy of from, or
+// with none if from is 0, for fork(), exec() and exit().
+void
+ksmset(struct ksmrange *rs, struct ksmrange *from)
+{
+	acquire(&ksm.lock);
+	ksm.nrange -= nranges(rs);
+	if(from)
+		memmove(rs, from, NKSMRANGE*sizeof(rs[0]));
+	else
+		memset(rs, 0, NKSMRANGE*sizeof(rs[0]));
+	ksm.nrange += nranges(rs);
+	release(&ksm.lock);
+}
+
+// Has any process opted in to page merging?  A hint for
+// ksmscan(), which need do nothing otherwise.
+int
+ksmactive(void)
+{
+	return ksm.nrange > 0;
+}
+
+// Opt [addr, addr+len) of the current process in to page
+// merging, or out of it.  Pages merged already stay shared
+// until written.  Returns 0, or -1 if the range is bad or
+// there is no free slot for it.
+int
+madvise(uint addr, uint len, int advice)
+{
+	struct ksmrange *r, *rs;
+	uint start, end;
+	int n;
+
+	start = PGROUNDDOWN(addr);
+	end = PGROUNDUP(addr + len);
+	if(addr + len < addr || end > KERNBASE || start >= end)
+		return -1;
+	rs = myproc()->ksm;
+	acquire(&ksm.lock);
+	if(advice == MADV_UNMERGEABLE){
+		ksm.nrange -= nranges(rs);
+		n = ksmclear(rs, start, end);
+		ksm.nrange += nranges(rs);
+		release(&ksm.lock);
+		return n;
+	}
+	if(advice != MADV_MERGEABLE){
+		release(&ksm.lock);
+		return -1;
+	}
+	// Ranges don't overlap; make room for the new one, which
+	// may swallow others.
+	n = 0;
+	for(r = rs; r < &rs[NKSMRANGE]; r++){
+		if(r->start <= start && r->end >= end){
+			release(&ksm.lock);
+			return 0;
+		}
+		if(r->end == 0 || (r->start >= start && r->end <= end))
+			n++;
+	}
+	if(n == 0){
+		release(&ksm.lock);
+		return -1;
+	}
+	ksm.nrange -= nranges(rs);
+	ksmclear(rs, start, end);
+	for(r = rs; r->end != 0; r++)
+		;
+	r->start = start;
+	r->end = end;
+	ksm.nrange += nranges(rs);
+	release(&ksm.lock);
+	return 0;
+}
+
+void
+ksmstat(struct ksmstat *st)
+{
+	struct ksment *e;
+
+	acquire(&ksm.lock);
+	st->shared = st->sharing = 0;
+	for(e = ksm.ent; e < &ksm.ent[NKSM]; e++){
+		if(e->page){
+			st->shared++;
+			st->sharing += krefs(e->page) - 1;
+		}
+	}
+	st->scanned = ksm.scanned;
+	st->merged = ksm.merged;
+	st->passes = ksm.passes;
+	release(&ksm.lock);
+}
@@ -0,0 +1,57 @@
+// Per-CPU kernel statistics, as returned by the cpustat system call.
+struct cpustat {
+	uint kalloc_hit;     // kalloc() served from this CPU's page cache
+	uint kalloc_refill;  // batches refilled from the global free list
+	uint kalloc_steal;   // batches stolen from another CPU's cache
+	uint kfree_drain;    // batches drained back to the global free list
+	uint kcache_pages;   // pages currently in this CPU's cache
+	uint kzalloc_hit;    // kalloc_zeroed() served from the pre-zeroed pool
+	uint kzalloc_miss;   // kalloc_zeroed() zeroed the page itself
+	uint kzero_fill;     // pages this CPU pre-zeroed while idle
+	uint tlb_flush;      // loads of %cr3
+	uint tlb_skip;       // context switches that kept %cr3
+	uint rq_len;         // processes waiting on this CPU's run queue
+	uint rq_steal;       // processes taken from other CPUs' run queues
+};
+
+// Memory use of the calling process, as returned by the
+// memstat system call.
+struct memstat {
+	uint sz;             // bytes of address space
+	uint resident;       // bytes backed by physical memory
+	uint huge;           // of which mapped with 4 MB pages
+	uint hugefault;      // heap stretches moved into 4 MB pages
+	uint hugefail;       // times no 4 MB page was free for one
+	uint hugesplit;      // 4 MB pages split up by fork() or sbrk()
+	uint swapped;        // bytes paged out to swap
+	uint shared;         // resident bytes also mapped or cached elsewhere
+};
+
+// System-wide paging activity, as returned by the swapstat
+// system call.
+struct swapstat {
+	uint physpages;      // pages of RAM given to the page allocator
+	uint slots;          // pages of swap space
+	uint used;           // of which in use
+	uint pageout;        // pages written to swap
+	uint pagein;         // pages read back from swap
+	uint scanned;        // PTEs looked at by the clock scan
+	uint fail;           // times no page could be paged out
+	uint zstored;        // pages held compressed in memory
+	uint zbytes;         // their compressed size
+	uint zpages;         // pages of memory holding them
+	uint zreject;        // pages that did not compress enough
+	uint zfault;         // faults served from compressed memory
+	uint zfaultkc;       // their total time, in units of 1024 cycles
+	uint dfault;         // faults served from the swap area
+	uint dfaultkc;       // their total time, in units of 1024 cycles
+};
+
+// Same-page merging, as returned by the ksmstat system call.
+struct ksmstat {
+	uint shared;         // merged pages in use
+	uint sharing;        // PTEs mapping them
+	uint scanned;        // pages the scanner has hashed
+	uint merged;         // PTEs it has pointed at a merged page
+	uint passes;         // passes over all opted-in memory
+};
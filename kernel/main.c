@@ -3,6 +3,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 
@@ -17,7 +18,11 @@ extern char end[]; // first address after kernel loaded from ELF file
 int
 main(void)
 {
+	uint64 tstart, tkinit;
+
+	tstart = rdtsc();
 	kinit1(end, P2V(4*1024*1024)); // phys page allocator
+	tkinit = rdtsc() - tstart;
 	kvmalloc();      // kernel page table
 	mpinit();        // detect other processors
 	lapicinit();     // interrupt controller
@@ -30,10 +35,19 @@ main(void)
 	tvinit();        // trap vectors
 	binit();         // buffer cache
 	fileinit();      // file table
+	iinit();         // inode cache
+	pipeinit();      // pipe cache
+	pcinit();        // file page cache
+	shminit();       // shared-memory objects
+	ksminit();       // same-page merging
 	ideinit();       // disk
 	startothers();   // start other processors
-	kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+	tkinit -= rdtsc();
+	kinit2(P2V(4*1024*1024), P2V(phystop)); // must come after startothers()
+	tkinit += rdtsc();
 	userinit();      // first user process
+	cprintf("boot: %d Kcycles to first process, %d in kinit\n",
+		(uint)((rdtsc() - tstart) >> 10), (uint)(tkinit >> 10));
 	mpmain();        // finish this processor's setup
 }
 
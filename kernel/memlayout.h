@@ -1,12 +1,20 @@
 // Memory layout
 
 #define EXTMEM  0x100000            // Start of extended memory
-#define PHYSTOP 0xE000000           // Top physical memory
+#define PHYSTOP 0xE000000           // Top physical memory if the BIOS gives no map
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
 
+// bootasm.S leaves the BIOS (INT 0x15, E820) memory map here:
+// a magic word, the 16-bit address just past the last entry,
+// then 20-byte entries starting at E820MAP+8.
+#define E820MAP   0x8000
+#define E820MAGIC 0x30323845        // "E820"
+
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0x80000000         // First kernel virtual address
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
+#define PHYSLIMIT (DEVSPACE-KERNBASE) // Most physical memory the kernel can map
+#define MMAPBASE 0x60000000         // mmap() regions lie between here and KERNBASE
 
 #define V2P(a) (((uint) (a)) - KERNBASE)
 #define P2V(a) ((void *)(((char *) (a)) + KERNBASE))
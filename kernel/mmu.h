@@ -10,6 +10,7 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
 
 // various segment selectors.
 #define SEG_KCODE 1  // kernel code
@@ -92,6 +93,8 @@
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
 
+#define PGSHIFT         12      // log2(PGSIZE)
+#define BIGPGSIZE       0x400000 // bytes mapped by a PTE_PS page directory entry
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
 
@@ -102,7 +105,17 @@
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global, kept in the TLB across lcr3
+#define PTE_COW         0x200   // Copy-on-write (available to software)
+#define PTE_SWAP        0x400   // Not present, paged out (available to software)
+
+// Page fault error code bits.
+#define FEC_P           0x1     // Protection violation, not a missing page
+#define FEC_WR          0x2     // Caused by a write
+#define FEC_U           0x4     // Caused in user mode
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
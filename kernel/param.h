@@ -1,9 +1,20 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // maximum number of live processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define NSLEEPQ      64  // hash buckets of sleeping processes
+#define NMLFQ         3  // scheduling levels; level l runs for 1<<l ticks
+#define MLFQBOOST   100  // ticks between moves of all processes to the top
+#define CFSGRAN (1<<20)  // cycles of vruntime a process may run ahead
+#define NICEMIN     -20  // range of setpriority() values
+#define NICEMAX      19
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NICACHE      50  // unreferenced inodes kept in memory
+#define NVMA         16  // file-backed memory regions per process
+#define NPCACHE     512  // file pages cached for mappings
+#define NKSMRANGE     4  // ranges per process opted in to page merging
+#define KSMSCAN     128  // pages looked at per tick for page merging
+#define NSHM         16  // shared-memory objects
+#define SHMPAGES    256  // most pages in a shared-memory object
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -11,4 +22,7 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define SWAPSIZE    32768  // blocks of swap space after the file system
+#define ZRAMPAGES    1024  // most pages holding compressed user pages
+#define MAXORDER     10  // largest kalloc_pages() block is 2^MAXORDER pages
 
@@ -0,0 +1,214 @@
+// Cache of file pages for mappings.
+//
+// Every process that runs a program maps the same pages of its
+// file, so pagefault() takes the pages of exec() and private
+// mmap() regions from here instead of reading a copy for each.
+// A cached page is mapped read-only, with PTE_COW if the region
+// is writable, and holds the file's bytes at (dev, inum, off),
+// n of them, and zeroes after.  The cache holds one reference
+// to each page and every mapping another, so a page outlives
+// its cache entry for as long as it is mapped.
+//
+// Writing to or truncating a file drops its pages from the
+// cache; regions that map them keep the old contents.
+//
+// Shared mmap() regions take their pages from here too, through
+// pcshared(), so that every process mapping a file page shared
+// maps the same page, writable.  Such an entry stays for as long
+// as any process maps its page, even if the file is written:
+// the mappers write their changes back themselves, and a write()
+// does not reach a page while it is mapped shared.  An
+// inode's pcached flag says whether it may have pages here, so
+// that writes to other files need not search.  pcget() inserts
+// and pcdrop() drops while holding the inode's lock, so neither
+// can miss the other.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+struct pcent {
+	uint dev;
+	uint inum;
+	uint off;
+	uint n;
+	char *page;               // 0 if unused
+	uint used;                // when last looked up
+	int shared;               // for shared mappings
+};
+
+struct {
+	struct spinlock lock;
+	struct pcent ent[NPCACHE];
+	uint clock;               // for used
+} pcache;
+
+void
+pcinit(void)
+{
+	initlock(&pcache.lock, "pcache");
+}
+
+// A shared entry matches whatever its n.
+static struct pcent*
+pclookup(uint dev, uint inum, uint off, uint n, int shared)
+{
+	struct pcent *e;
+
+	for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++)
+		if(e->page && e->dev == dev && e->inum == inum && e->off == off &&
+		   e->shared == shared && (shared || e->n == n))
+			return e;
+	return 0;
+}
+
+// Is e's page mapped shared, so that it must stay?
+static int
+pcpinned(struct pcent *e)
+{
+	return e->shared && krefs(e->page) > 1;
+}
+
+// Look up or read in the page of ip at off, as for pcget()
+// and pcshared().  Caller must hold ip->lock.
+static char*
+pcfill(struct inode *ip, uint off, uint n, int shared)
+{
+	struct pcent *e, *victim;
+	char *mem;
+
+	acquire(&pcache.lock);
+	if((e = pclookup(ip->dev, ip->inum, off, n, shared)) != 0){
+		e->used = ++pcache.clock;
+		kdup(e->page);
+		release(&pcache.lock);
+		return e->page;
+	}
+	release(&pcache.lock);
+
+	if((mem = kalloc_zeroed()) == 0)
+		return 0;
+	if(n > 0 && readi(ip, mem, off, n) != n){
+		kfree(mem);
+		return 0;
+	}
+
+	// No one else can have added it, since we hold ip's lock.
+	// Replace the entry used least recently, but not a page
+	// that is mapped shared.
+	acquire(&pcache.lock);
+	victim = 0;
+	for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+		if(e->page == 0){
+			victim = e;
+			break;
+		}
+		if(!pcpinned(e) && (victim == 0 || e->used < victim->used))
+			victim = e;
+	}
+	if(victim == 0){
+		release(&pcache.lock);
+		kfree(mem);
+		return 0;
+	}
+	if(victim->page)
+		kfree(victim->page);
+	victim->dev = ip->dev;
+	victim->inum = ip->inum;
+	victim->off = off;
+	victim->n = n;
+	victim->page = mem;
+	victim->used = ++pcache.clock;
+	victim->shared = shared;
+	kdup(mem);
+	release(&pcache.lock);
+	ip->pcached = 1;
+	return mem;
+}
+
+// Return the page holding the n bytes of ip at off, with a
+// reference for the caller, reading it in if it is not cached.
+// Returns 0 if there is no memory, or if ip is too short.
+// May sleep.
+char*
+pcget(struct inode *ip, uint off, uint n)
+{
+	char *mem;
+
+	ilock(ip);
+	mem = pcfill(ip, off, n, 0);
+	iunlock(ip);
+	return mem;
+}
+
+// Return the page of ip at page-aligned off that every shared
+// mapping of it maps, with a reference for the caller, reading
+// it in if no one maps it.  Bytes past the end of the file are
+// zero.  Returns 0 if there is no memory.  May sleep.
+char*
+pcshared(struct inode *ip, uint off)
+{
+	char *mem;
+	uint n;
+
+	ilock(ip);
+	n = off < ip->size ? ip->size - off : 0;
+	if(n > PGSIZE)
+		n = PGSIZE;
+	mem = pcfill(ip, off, n, 1);
+	iunlock(ip);
+	return mem;
+}
+
+// ip's contents are changing: forget its pages, except
+// those mapped shared.  Caller must hold ip->lock.
+void
+pcdrop(struct inode *ip)
+{
+	struct pcent *e;
+	int kept;
+
+	if(!ip->pcached)
+		return;
+	kept = 0;
+	acquire(&pcache.lock);
+	for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+		if(e->page && e->dev == ip->dev && e->inum == ip->inum){
+			if(pcpinned(e)){
+				kept = 1;
+				continue;
+			}
+			kfree(e->page);
+			e->page = 0;
+		}
+	}
+	release(&pcache.lock);
+	ip->pcached = kept;
+}
+
+// Free the least recently used cached page that no process
+// maps, for swapout().  Returns 0, or -1 if there is none.
+int
+pcreclaim(void)
+{
+	struct pcent *e, *victim;
+
+	acquire(&pcache.lock);
+	victim = 0;
+	for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++)
+		if(e->page && krefs(e->page) == 1 && (victim == 0 || e->used < victim->used))
+			victim = e;
+	if(victim == 0){
+		release(&pcache.lock);
+		return -1;
+	}
+	kfree(victim->page);
+	victim->page = 0;
+	release(&pcache.lock);
+	return 0;
+}
@@ -2,9 +2,9 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
 
@@ -19,6 +19,14 @@ struct pipe {
 	int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+	pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +36,7 @@ pipealloc(struct file **f0, struct file **f1)
 	*f0 = *f1 = 0;
 	if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
 		goto bad;
-	if((p = (struct pipe*)kalloc()) == 0)
+	if((p = kmem_cache_alloc(pipecache)) == 0)
 		goto bad;
 	p->readopen = 1;
 	p->writeopen = 1;
@@ -47,7 +55,7 @@ pipealloc(struct file **f0, struct file **f1)
 
 	bad:
 	if(p)
-		kfree((char*)p);
+		kmem_cache_free(pipecache, p);
 	if(*f0)
 		fileclose(*f0);
 	if(*f1)
@@ -68,7 +76,7 @@ pipeclose(struct pipe *p, int writable)
 	}
 	if(p->readopen == 0 && p->writeopen == 0){
 		release(&p->lock);
-		kfree((char*)p);
+		kmem_cache_free(pipecache, p);
 	} else
 		release(&p->lock);
 }
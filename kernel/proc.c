@@ -4,26 +4,71 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "proc.h"
 
+// Process structures come from proccache and are linked on
+// ptable.list for as long as they are in use.
+//
+// ptable.lock protects the list, and parent links.  Each
+// process's own lock protects its state and sleep channel, and
+// is held across the context switch, from sched() to the
+// scheduler and from the scheduler back to the process, so that
+// no other CPU can run a process until it has stopped running.
+// A RUNNABLE process is on the run queue of one CPU; an idle
+// CPU takes processes from the others' queues.
+//
+// Under SCHED_MLFQ, run queues have NMLFQ levels, and a CPU
+// runs the processes of the highest level first.  A process
+// that uses up its level's quantum moves down a level, so
+// CPU-bound processes sink below interactive ones, until
+// mlfqboost() lifts them all back up.  Under SCHED_CFS, a CPU
+// runs the process that has had the least CPU time, weighted
+// by nice value (vruntime).  SCHED_RR keeps every process on
+// the top level and switches at every tick.
+//
+// Locks are taken in the order ptable.lock, sleepq bucket
+// lock, process lock, run queue lock.
 struct {
 	struct spinlock lock;
-	struct proc proc[NPROC];
+	struct proc *list;
+	int nproc;
 } ptable;
 
+static struct kmem_cache *proccache;
+
+// Sleeping processes, hashed by channel, so that wakeup() need
+// only look at those that may be sleeping on its channel.
+// A process is on the list of its channel's bucket from when
+// it goes to sleep until it is running again, and takes itself
+// off.  A bucket's lock is taken before a process lock.
+struct sleepq {
+	struct spinlock lock;
+	struct proc *list;
+} sleepq[NSLEEPQ];
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
+static int toplevel(struct proc *p);
 
 void
 pinit(void)
 {
+	struct cpu *c;
+	int i;
+
 	initlock(&ptable.lock, "ptable");
+	for(c = cpus; c < &cpus[NCPU]; c++)
+		initlock(&c->rqlock, "runq");
+	for(i = 0; i < NSLEEPQ; i++)
+		initlock(&sleepq[i].lock, "sleepq");
+	proccache = kmem_cache_create("proc", sizeof(struct proc));
 }
 
 // Must be called with interrupts disabled
@@ -67,26 +112,30 @@ myproc(void)
 	return p;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
-// state required to run in the kernel.
-// Otherwise return 0.
+// Allocate a proc, add it to the process table in
+// state EMBRYO and initialize state required to run
+// in the kernel.
+// Returns 0 if out of memory or NPROC are in use.
 static struct proc*
 allocproc(void)
 {
 	struct proc *p;
 	char *sp;
 
-	acquire(&ptable.lock);
-
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-		if(p->state == UNUSED)
-			goto found;
-
-	release(&ptable.lock);
-	return 0;
+	if((p = kmem_cache_alloc(proccache)) == 0)
+		return 0;
+	memset(p, 0, sizeof(*p));
+	initlock(&p->lock, "proc");
 
-found:
+	acquire(&ptable.lock);
+	if(ptable.nproc >= NPROC){
+		release(&ptable.lock);
+		kmem_cache_free(proccache, p);
+		return 0;
+	}
+	ptable.nproc++;
+	p->next = ptable.list;
+	ptable.list = p;
 	p->state = EMBRYO;
 	p->pid = nextpid++;
 
@@ -94,7 +143,9 @@ found:
 
 	// Allocate kernel stack.
 	if((p->kstack = kalloc()) == 0){
-		p->state = UNUSED;
+		acquire(&ptable.lock);
+		freeproc(p);
+		release(&ptable.lock);
 		return 0;
 	}
 	sp = p->kstack + KSTACKSIZE;
@@ -116,6 +167,23 @@ found:
 	return p;
 }
 
+// Remove p from the process table and free it.
+// The caller must already have freed p's kernel stack
+// and page table, and must hold ptable.lock.
+static void
+freeproc(struct proc *p)
+{
+	struct proc **pp;
+
+	for(pp = &ptable.list; *pp != p; pp = &(*pp)->next)
+		if(*pp == 0)
+			panic("freeproc");
+	*pp = p->next;
+	ptable.nproc--;
+	p->state = UNUSED;
+	kmem_cache_free(proccache, p);
+}
+
 // Set up first user process.
 void
 userinit(void)
@@ -146,14 +214,15 @@ userinit(void)
 	// run this process. the acquire forces the above
 	// writes to be visible, and the lock is also needed
 	// because the assignment might not be atomic.
-	acquire(&ptable.lock);
-
-	p->state = RUNNABLE;
-
-	release(&ptable.lock);
+	acquire(&p->lock);
+	setrunnable(p);
+	release(&p->lock);
 }
 
 // Grow current process's memory by n bytes.
+// Growing only reserves the address space; pagefault()
+// allocates each page when it is first touched.  A process
+// may not reserve more than the machine's memory and swap.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -163,11 +232,13 @@ growproc(int n)
 
 	sz = curproc->sz;
 	if(n > 0){
-		if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+		if(sz + n < sz || sz + n > MMAPBASE || sz + n > phystop + swapsize())
 			return -1;
+		sz += n;
 	} else if(n < 0){
-		if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+		if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) != curproc->sz + n)
 			return -1;
+		vmatrim(curproc->vma, sz);
 	}
 	curproc->sz = sz;
 	switchuvm(curproc);
@@ -190,10 +261,12 @@ fork(void)
 	}
 
 	// Copy process state from proc.
-	if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+	if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz, curproc->vma)) == 0){
 		kfree(np->kstack);
 		np->kstack = 0;
-		np->state = UNUSED;
+		acquire(&ptable.lock);
+		freeproc(np);
+		release(&ptable.lock);
 		return -1;
 	}
 	np->sz = curproc->sz;
@@ -207,16 +280,91 @@ fork(void)
 		if(curproc->ofile[i])
 			np->ofile[i] = filedup(curproc->ofile[i]);
 	np->cwd = idup(curproc->cwd);
+	vmadup(np->vma, curproc->vma);
+	ksmset(np->ksm, curproc->ksm);
+	np->nice = curproc->nice;
+	np->level = toplevel(np);
 
 	safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
 	pid = np->pid;
 
-	acquire(&ptable.lock);
+	acquire(&np->lock);
+	setrunnable(np);
+	release(&np->lock);
+
+	return pid;
+}
 
-	np->state = RUNNABLE;
+// Create a child process running the program at path with
+// arguments argv, without copying the caller's memory.  The
+// child's file descriptor i is a dup of the caller's fds[i],
+// or closed if fds[i] is -1; with fds == 0 the child inherits
+// all of the caller's descriptors.
+// Returns the child's pid, or -1 on error.
+int
+spawn(char *path, char **argv, int *fds, int nfds)
+{
+	int i, pid;
+	struct proc *np;
+	struct image im;
+	struct proc *curproc = myproc();
 
-	release(&ptable.lock);
+	if(fds){
+		if(nfds < 0 || nfds > NOFILE)
+			return -1;
+		for(i = 0; i < nfds; i++)
+			if(fds[i] != -1 && (fds[i] < 0 || fds[i] >= NOFILE ||
+			   curproc->ofile[fds[i]] == 0))
+				return -1;
+	}
+
+	// Allocate process.
+	if((np = allocproc()) == 0)
+		return -1;
+
+	if(loadimage(path, argv, &im) < 0){
+		kfree(np->kstack);
+		np->kstack = 0;
+		acquire(&ptable.lock);
+		freeproc(np);
+		release(&ptable.lock);
+		return -1;
+	}
+	np->pgdir = im.pgdir;
+	np->sz = im.sz;
+	memmove(np->vma, im.vma, sizeof(im.vma));
+	np->parent = curproc;
+	np->nice = curproc->nice;
+	np->level = toplevel(np);
+
+	memset(np->tf, 0, sizeof(*np->tf));
+	np->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+	np->tf->ds = (SEG_UDATA << 3) | DPL_USER;
+	np->tf->es = np->tf->ds;
+	np->tf->ss = np->tf->ds;
+	np->tf->eflags = FL_IF;
+	np->tf->esp = im.sp;
+	np->tf->eip = im.entry;  // main
+
+	if(fds){
+		for(i = 0; i < nfds; i++)
+			if(fds[i] != -1)
+				np->ofile[i] = filedup(curproc->ofile[fds[i]]);
+	} else {
+		for(i = 0; i < NOFILE; i++)
+			if(curproc->ofile[i])
+				np->ofile[i] = filedup(curproc->ofile[i]);
+	}
+	np->cwd = idup(curproc->cwd);
+
+	safestrcpy(np->name, im.name, sizeof(np->name));
+
+	pid = np->pid;
+
+	acquire(&np->lock);
+	setrunnable(np);
+	release(&np->lock);
 
 	return pid;
 }
@@ -234,6 +382,11 @@ exit(void)
 	if(curproc == initproc)
 		panic("init exiting");
 
+	// exit() may be called from trap() outside any system call,
+	// but it reads user pages below (vmaflush()), so keep evict()
+	// and KSM from touching them, as during a system call.
+	curproc->insyscall = 1;
+
 	// Close all open files.
 	for(fd = 0; fd < NOFILE; fd++){
 		if(curproc->ofile[fd]){
@@ -242,27 +395,33 @@ exit(void)
 		}
 	}
 
+	vmaflush(curproc->pgdir, curproc->vma);
+	ksmset(curproc->ksm, 0);
 	begin_op();
 	iput(curproc->cwd);
+	vmaclear(curproc->vma);
 	end_op();
 	curproc->cwd = 0;
 
 	acquire(&ptable.lock);
 
 	// Parent might be sleeping in wait().
-	wakeup1(curproc->parent);
+	wakeup(curproc->parent);
 
 	// Pass abandoned children to init.
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+	for(p = ptable.list; p; p = p->next){
 		if(p->parent == curproc){
 			p->parent = initproc;
 			if(p->state == ZOMBIE)
-				wakeup1(initproc);
+				wakeup(initproc);
 		}
 	}
 
-	// Jump into the scheduler, never to return.
+	// Jump into the scheduler, never to return.  wait() does
+	// not free us before the scheduler releases our lock.
+	acquire(&curproc->lock);
 	curproc->state = ZOMBIE;
+	release(&ptable.lock);
 	sched();
 	panic("zombie exit");
 }
@@ -280,21 +439,19 @@ wait(void)
 	for(;;){
 		// Scan through table looking for exited children.
 		havekids = 0;
-		for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+		for(p = ptable.list; p; p = p->next){
 			if(p->parent != curproc)
 				continue;
 			havekids = 1;
 			if(p->state == ZOMBIE){
-				// Found one.
+				// Found one.  Let it finish switching away.
+				acquire(&p->lock);
+				release(&p->lock);
 				pid = p->pid;
 				kfree(p->kstack);
 				p->kstack = 0;
 				freevm(p->pgdir);
-				p->pid = 0;
-				p->parent = 0;
-				p->name[0] = 0;
-				p->killed = 0;
-				p->state = UNUSED;
+				freeproc(p);
 				release(&ptable.lock);
 				return pid;
 			}
@@ -306,15 +463,405 @@ wait(void)
 			return -1;
 		}
 
-		// Wait for children to exit.  (See wakeup1 call in proc_exit.)
+		// Wait for children to exit.  (See wakeup call in exit.)
 		sleep(curproc, &ptable.lock);  //DOC: wait-sleep
 	}
 }
 
+#ifndef SCHEDCLASS
+#define SCHEDCLASS SCHED_MLFQ
+#endif
+
+static int schedclass = SCHEDCLASS;
+
+// CPU shares under SCHED_CFS, by nice value from NICEMIN:
+// each step of nice is worth about 10% of CPU time.
+static const uint niceweight[NICEMAX-NICEMIN+1] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	 9548,  7620,  6100,  4904,  3906,
+	 3121,  2501,  1991,  1586,  1277,
+	 1024,   820,   655,   526,   423,
+	  335,   272,   215,   172,   137,
+	  110,    87,    70,    56,    45,
+	   36,    29,    23,    18,    15,
+};
+
+// Add the cycles p has run since it was last charged to its
+// vruntime, scaled so that a process of weight 1024 (nice 0)
+// is charged one for one.  The kernel has no 64-bit division,
+// so this multiplies by 2^32/weight and shifts instead.
+// Caller holds p->lock.
+static void
+charge(struct proc *p)
+{
+	uint64 now, d;
+
+	now = rdtsc();
+	d = now - p->tscstart;
+	p->tscstart = now;
+	if(d > 0xffffffff)
+		d = 0xffffffff;
+	p->vruntime += ((uint64)(uint)d * (0xffffffff / niceweight[p->nice - NICEMIN])) >> 22;
+}
+
+// SCHED_CFS keeps each CPU's queue in an AVL tree ordered by
+// vruntime, linked through rqleft and rqright.
+
+static int
+treeheight(struct proc *t)
+{
+	return t ? t->rqheight : 0;
+}
+
+static void
+treefix(struct proc *t)
+{
+	int l, r;
+
+	l = treeheight(t->rqleft);
+	r = treeheight(t->rqright);
+	t->rqheight = 1 + (l > r ? l : r);
+}
+
+static struct proc*
+rotleft(struct proc *t)
+{
+	struct proc *r = t->rqright;
+
+	t->rqright = r->rqleft;
+	r->rqleft = t;
+	treefix(t);
+	treefix(r);
+	return r;
+}
+
+static struct proc*
+rotright(struct proc *t)
+{
+	struct proc *l = t->rqleft;
+
+	t->rqleft = l->rqright;
+	l->rqright = t;
+	treefix(t);
+	treefix(l);
+	return l;
+}
+
+// Rebalance t, whose subtrees are balanced but may differ in
+// height by two.  Returns the new root.
+static struct proc*
+treebalance(struct proc *t)
+{
+	int b;
+
+	treefix(t);
+	b = treeheight(t->rqleft) - treeheight(t->rqright);
+	if(b > 1){
+		if(treeheight(t->rqleft->rqleft) < treeheight(t->rqleft->rqright))
+			t->rqleft = rotleft(t->rqleft);
+		return rotright(t);
+	}
+	if(b < -1){
+		if(treeheight(t->rqright->rqright) < treeheight(t->rqright->rqleft))
+			t->rqright = rotright(t->rqright);
+		return rotleft(t);
+	}
+	return t;
+}
+
+// Insert p into tree t, after any process with the same
+// vruntime.  Returns the new root.
+static struct proc*
+treeinsert(struct proc *t, struct proc *p)
+{
+	if(t == 0){
+		p->rqleft = p->rqright = 0;
+		p->rqheight = 1;
+		return p;
+	}
+	if(p->vruntime < t->vruntime)
+		t->rqleft = treeinsert(t->rqleft, p);
+	else
+		t->rqright = treeinsert(t->rqright, p);
+	return treebalance(t);
+}
+
+// Remove the process with the lowest vruntime from the
+// non-empty tree t, and set *min to it.  Returns the new root.
+static struct proc*
+treepopmin(struct proc *t, struct proc **min)
+{
+	if(t->rqleft == 0){
+		*min = t;
+		return t->rqright;
+	}
+	t->rqleft = treepopmin(t->rqleft, min);
+	return treebalance(t);
+}
+
+// Append p to the queue of c for p's level.
+// Caller holds c->rqlock.
+static void
+runqappend(struct cpu *c, struct proc *p)
+{
+	int l = p->level;
+
+	p->rqnext = 0;
+	if(c->rqtail[l])
+		c->rqtail[l]->rqnext = p;
+	else
+		c->rqhead[l] = p;
+	c->rqtail[l] = p;
+}
+
+// Append p, which has just become RUNNABLE, to c's run queue.
+// Caller holds p->lock.
+static void
+runqput(struct cpu *c, struct proc *p)
+{
+	acquire(&c->rqlock);
+	if(schedclass == SCHED_CFS){
+		// A process new to c starts level with the processes
+		// there.  One that slept keeps up to CFSGRAN of credit,
+		// but no more, or it would then hold c for as long as
+		// it slept.
+		if(p->cpu != c)
+			p->vruntime = c->minvruntime;
+		else if(p->vruntime + CFSGRAN < c->minvruntime)
+			p->vruntime = c->minvruntime - CFSGRAN;
+		c->rqroot = treeinsert(c->rqroot, p);
+	} else
+		runqappend(c, p);
+	c->rqlen++;
+	release(&c->rqlock);
+}
+
+// Take the first process of the highest non-empty level of
+// c's run queue, or under SCHED_CFS the one with the lowest
+// vruntime, or return 0.
+static struct proc*
+runqget(struct cpu *c)
+{
+	struct proc *p;
+	int l;
+
+	if(c->rqlen == 0)  // don't take the lock just to see that
+		return 0;
+	acquire(&c->rqlock);
+	p = 0;
+	if(schedclass == SCHED_CFS && c->rqroot){
+		c->rqroot = treepopmin(c->rqroot, &p);
+		if(p->vruntime > c->minvruntime)
+			c->minvruntime = p->vruntime;
+		c->rqlen--;
+	}
+	for(l = 0; l < NMLFQ && p == 0; l++){
+		if((p = c->rqhead[l]) != 0){
+			c->rqhead[l] = p->rqnext;
+			if(c->rqhead[l] == 0)
+				c->rqtail[l] = 0;
+			c->rqlen--;
+			break;
+		}
+	}
+	release(&c->rqlock);
+	return p;
+}
+
+// Move c's queued processes to the queues of the levels that
+// mlfqboost() gave them, keeping their order.
+static void
+runqsort(struct cpu *c)
+{
+	struct proc *p, *next, *list, **tail;
+	int l;
+
+	acquire(&c->rqlock);
+	list = 0;
+	tail = &list;
+	for(l = 0; l < NMLFQ; l++){
+		if(c->rqhead[l]){
+			*tail = c->rqhead[l];
+			tail = &c->rqtail[l]->rqnext;
+		}
+		c->rqhead[l] = c->rqtail[l] = 0;
+	}
+	for(p = list; p; p = next){
+		next = p->rqnext;
+		runqappend(c, p);
+	}
+	release(&c->rqlock);
+}
+
+// Take a process from the longest run queue of another CPU,
+// for c, which has nothing to run.  Returns 0 if there is none.
+static struct proc*
+runqsteal(struct cpu *c)
+{
+	struct cpu *v, *busiest;
+	struct proc *p;
+
+	busiest = 0;
+	for(v = cpus; v < &cpus[ncpu]; v++)
+		if(v != c && v->rqlen > 0 && (busiest == 0 || v->rqlen > busiest->rqlen))
+			busiest = v;
+	if(busiest == 0 || (p = runqget(busiest)) == 0)
+		return 0;
+	c->steal++;
+	if(schedclass == SCHED_CFS){
+		// p's vruntime means nothing next to c's processes.
+		acquire(&c->rqlock);
+		p->vruntime = c->minvruntime;
+		release(&c->rqlock);
+	}
+	return p;
+}
+
+// Mark p RUNNABLE and queue it on a CPU: the one it last ran
+// on, whose caches may still hold its memory, if nothing else
+// is waiting there, and otherwise the one with the shortest
+// run queue.  Caller holds p->lock.
+static void
+setrunnable(struct proc *p)
+{
+	struct cpu *c, *best;
+
+	p->state = RUNNABLE;
+	best = p->cpu;
+	if(best == 0 || best->rqlen > 0){
+		best = cpus;
+		for(c = cpus; c < &cpus[ncpu]; c++)
+			if(c->rqlen < best->rqlen)
+				best = c;
+	}
+	runqput(best, p);
+}
+
+// The level p starts at and is boosted to: the top one, or
+// under SCHED_MLFQ a lower one the nicer p is.
+static int
+toplevel(struct proc *p)
+{
+	int l;
+
+	if(schedclass != SCHED_MLFQ || p->nice <= 0)
+		return 0;
+	l = 1 + p->nice*(NMLFQ-1)/(NICEMAX+1);
+	return l < NMLFQ ? l : NMLFQ-1;
+}
+
+// The clock interrupted the current process: charge it a tick.
+// Under SCHED_MLFQ, once it has run for its level's quantum,
+// sleeps included, it moves down a level and gives up the CPU.
+// It also gives way to a process of a higher level queued on
+// this CPU.  Under SCHED_CFS it gives way once it is CFSGRAN
+// ahead of the process queued with the lowest vruntime, and
+// under SCHED_RR it always does.
+void
+schedtick(void)
+{
+	struct proc *p = myproc();
+	struct proc *t;
+	struct cpu *c;
+	int l, preempt;
+
+	acquire(&p->lock);
+	c = mycpu();
+	preempt = 0;
+	switch(schedclass){
+	case SCHED_RR:
+		preempt = 1;
+		break;
+	case SCHED_MLFQ:
+		if(++p->used >= (1 << p->level)){
+			if(p->level < NMLFQ-1)
+				p->level++;
+			p->used = 0;
+			preempt = 1;
+		}
+		for(l = 0; l < p->level; l++)
+			if(c->rqhead[l])
+				preempt = 1;
+		break;
+	case SCHED_CFS:
+		charge(p);
+		acquire(&c->rqlock);
+		for(t = c->rqroot; t && t->rqleft; t = t->rqleft)
+			;
+		if(t && t->vruntime + CFSGRAN < p->vruntime)
+			preempt = 1;
+		release(&c->rqlock);
+		break;
+	}
+	if(preempt){
+		p->state = RUNNABLE;
+		sched();
+	}
+	release(&p->lock);
+}
+
+// Move every process back to its top level, so that processes
+// that have sunk to the bottom are not starved by a stream of
+// new or interactive ones.  Called every MLFQBOOST ticks.
+void
+mlfqboost(void)
+{
+	struct proc *p;
+	struct cpu *c;
+
+	if(schedclass != SCHED_MLFQ)
+		return;
+	acquire(&ptable.lock);
+	for(p = ptable.list; p; p = p->next){
+		acquire(&p->lock);
+		p->level = toplevel(p);
+		p->used = 0;
+		release(&p->lock);
+	}
+	for(c = cpus; c < &cpus[ncpu]; c++)
+		runqsort(c);
+	release(&ptable.lock);
+}
+
+// Set the nice value of process pid, or of the caller if pid
+// is 0.  Under SCHED_MLFQ a process made nicer drops to its
+// new top level at once, and one made less nice rises at the
+// next boost; under SCHED_CFS the weight changes for the time
+// it runs from now on.  Returns
+// 0, or -1 if there is no such process or nice is out of range.
+int
+setpriority(int pid, int nice)
+{
+	struct proc *p;
+
+	if(nice < NICEMIN || nice > NICEMAX)
+		return -1;
+	if(pid == 0)
+		pid = myproc()->pid;
+	acquire(&ptable.lock);
+	for(p = ptable.list; p; p = p->next){
+		if(p->pid == pid && p->state != UNUSED && p->state != EMBRYO){
+			acquire(&p->lock);
+			p->nice = nice;
+			if(p->level < toplevel(p)){
+				p->level = toplevel(p);
+				p->used = 0;
+			}
+			release(&p->lock);
+			release(&ptable.lock);
+			return 0;
+		}
+	}
+	release(&ptable.lock);
+	return -1;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - choose a process to run, from this CPU's run queue,
+//      or failing that from another CPU's
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -331,40 +878,50 @@ scheduler(void)
 		// Enable interrupts on this processor.
 		sti();
 
-		// If there are no processes to run, halt the CPU
-		// until the next interrupt.
-		if(idle)
+		// If there are no processes to run, pre-zero a free
+		// page for kalloc_zeroed(), or once the pool is full,
+		// halt the CPU until the next interrupt.
+		if(idle && !kzeroidle())
 			hlt();
 		idle = 1;
 
-		// Loop over process table looking for process to run.
-		acquire(&ptable.lock);
-		for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-			if(p->state != RUNNABLE)
-				continue;
-
-			idle = 0;
-			// Switch to chosen process.  It is the process's job
-			// to release ptable.lock and then reacquire it
-			// before jumping back to us.
-			c->proc = p;
-			switchuvm(p);
-			p->state = RUNNING;
-
-			swtch(&(c->scheduler), p->context);
-			switchkvm();
-
-			// Process is done running for now.
-			// It should have changed its p->state before coming back.
-			c->proc = 0;
-		}
-		release(&ptable.lock);
+		// Look for identical pages to merge.
+		ksmscan();
 
+		if((p = runqget(c)) == 0 && (p = runqsteal(c)) == 0)
+			continue;
+		idle = 0;
+
+		// p may still be switching away on the CPU that queued
+		// it; its lock is free once it has.
+		acquire(&p->lock);
+		if(p->state != RUNNABLE)
+			panic("scheduler");
+
+		// Switch to chosen process.  It is the process's job
+		// to release p->lock and then reacquire it before
+		// jumping back to us.  Its page table stays loaded
+		// afterwards, so that resumeuvm() need not reload
+		// %cr3 if it is picked again.
+		c->proc = p;
+		resumeuvm(p);
+		p->state = RUNNING;
+		p->cpu = c;
+		if(schedclass == SCHED_CFS)
+			p->tscstart = rdtsc();
+
+		swtch(&(c->scheduler), p->context);
+
+		// Process is done running for now.
+		// It should have changed its p->state before coming back.
+		c->proc = 0;
+		release(&p->lock);
 	}
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
+// Enter scheduler.  Must hold only p->lock
+// and have changed proc->state; if it is RUNNABLE,
+// p goes back on this CPU's run queue. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->ncli, but that would
@@ -376,27 +933,34 @@ sched(void)
 	int intena;
 	struct proc *p = myproc();
 
-	if(!holding(&ptable.lock))
-		panic("sched ptable.lock");
+	if(!holding(&p->lock))
+		panic("sched p->lock");
 	if(mycpu()->ncli != 1)
 		panic("sched locks");
 	if(p->state == RUNNING)
 		panic("sched running");
 	if(readeflags()&FL_IF)
 		panic("sched interruptible");
+	if(schedclass == SCHED_CFS)
+		charge(p);
+	if(p->state == RUNNABLE)
+		runqput(mycpu(), p);
 	intena = mycpu()->intena;
 	swtch(&p->context, mycpu()->scheduler);
 	mycpu()->intena = intena;
 }
 
-// Give up the CPU for one scheduling round.
+// Give up the CPU for one scheduling round, going to the
+// back of this CPU's run queue.
 void
 yield(void)
 {
-	acquire(&ptable.lock);  //DOC: yieldlock
-	myproc()->state = RUNNABLE;
+	struct proc *p = myproc();
+
+	acquire(&p->lock);  //DOC: yieldlock
+	p->state = RUNNABLE;
 	sched();
-	release(&ptable.lock);
+	release(&p->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -405,27 +969,37 @@ void
 forkret(void)
 {
 	static int first = 1;
-	// Still holding ptable.lock from scheduler.
-	release(&ptable.lock);
+	// Still holding p->lock from scheduler.
+	release(&myproc()->lock);
 
 	if (first) {
 		// Some initialization functions must be run in the context
 		// of a regular process (e.g., they call sleep), and thus cannot
 		// be run from main().
 		first = 0;
-		iinit(ROOTDEV);
+		fsinit(ROOTDEV);
 		initlog(ROOTDEV);
+		swapinit(ROOTDEV);
 	}
 
 	// Return to "caller", actually trapret (see allocproc).
 }
 
+// The sleepq bucket of chan.
+static uint
+chanhash(void *chan)
+{
+	return ((uint)chan * 2654435761U >> 16) % NSLEEPQ;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
 	struct proc *p = myproc();
+	struct sleepq *q;
+	struct proc **pp;
 
 	if(p == 0)
 		panic("sleep");
@@ -433,51 +1007,57 @@ sleep(void *chan, struct spinlock *lk)
 	if(lk == 0)
 		panic("sleep without lk");
 
-	// Must acquire ptable.lock in order to
-	// change p->state and then call sched.
-	// Once we hold ptable.lock, we can be
+	// Must acquire chan's bucket lock in order to
+	// join its list, and p->lock in order to change
+	// p->state and then call sched.
+	// Once we hold the bucket lock, we can be
 	// guaranteed that we won't miss any wakeup
-	// (wakeup runs with ptable.lock locked),
+	// (wakeup locks the bucket to look for us),
 	// so it's okay to release lk.
-	if(lk != &ptable.lock){  //DOC: sleeplock0
-		acquire(&ptable.lock);  //DOC: sleeplock1
-		release(lk);
-	}
+	q = &sleepq[chanhash(chan)];
+	acquire(&q->lock);  //DOC: sleeplock1
+	acquire(&p->lock);
+	release(lk);
+
 	// Go to sleep.
 	p->chan = chan;
 	p->state = SLEEPING;
+	p->sleepnext = q->list;
+	q->list = p;
+	release(&q->lock);
 
 	sched();
 
-	// Tidy up.
+	// Tidy up.  wakeup() passes over us from here on, as we
+	// are no longer SLEEPING.
 	p->chan = 0;
+	release(&p->lock);
+	acquire(&q->lock);
+	for(pp = &q->list; *pp != p; pp = &(*pp)->sleepnext)
+		;
+	*pp = p->sleepnext;
+	release(&q->lock);
 
 	// Reacquire original lock.
-	if(lk != &ptable.lock){  //DOC: sleeplock2
-		release(&ptable.lock);
-		acquire(lk);
-	}
+	acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-static void
-wakeup1(void *chan)
+void
+wakeup(void *chan)
 {
+	struct sleepq *q;
 	struct proc *p;
 
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	q = &sleepq[chanhash(chan)];
+	acquire(&q->lock);
+	for(p = q->list; p; p = p->sleepnext){
+		acquire(&p->lock);
 		if(p->state == SLEEPING && p->chan == chan)
-			p->state = RUNNABLE;
-}
-
-// Wake up all processes sleeping on chan.
-void
-wakeup(void *chan)
-{
-	acquire(&ptable.lock);
-	wakeup1(chan);
-	release(&ptable.lock);
+			setrunnable(p);
+		release(&p->lock);
+	}
+	release(&q->lock);
 }
 
 // Kill the process with the given pid.
@@ -489,12 +1069,14 @@ kill(int pid)
 	struct proc *p;
 
 	acquire(&ptable.lock);
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+	for(p = ptable.list; p; p = p->next){
 		if(p->pid == pid){
+			acquire(&p->lock);
 			p->killed = 1;
 			// Wake process from sleep if necessary.
 			if(p->state == SLEEPING)
-				p->state = RUNNABLE;
+				setrunnable(p);
+			release(&p->lock);
 			release(&ptable.lock);
 			return 0;
 		}
@@ -503,6 +1085,179 @@ kill(int pid)
 	return -1;
 }
 
+// The clock hand of evict(): the next page it looks at is
+// handva of process handpid.
+static int handpid;
+static uint handva;
+
+// May evict() take pages from p?  Only if nobody is using
+// p's page table: p must be preempted in user space, or be
+// the caller, and not in a system call, which may have made
+// pages present with faultin() and count on them staying.
+static int
+evictable(struct proc *p)
+{
+	if(p->pgdir == 0 || p->insyscall)
+		return 0;
+	return p == myproc() || (p->state == RUNNABLE && !p->infault);
+}
+
+// Choose a user page to page out, by a clock scan over the
+// processes, and replace its PTE with the swap PTE e.
+// Returns the page, which is no longer mapped, or 0 if two
+// turns of the clock found none.
+char*
+evict(pte_t e)
+{
+	struct proc *p, *start;
+	pte_t *pte;
+	char *mem;
+	int n;
+
+	acquire(&ptable.lock);
+	for(start = ptable.list; start; start = start->next)
+		if(start->pid == handpid)
+			break;
+	if(start == 0){
+		start = ptable.list;
+		handva = 0;
+	}
+	p = start;
+	for(n = 0; n <= 2*ptable.nproc; n++){
+		acquire(&p->lock);
+		if(evictable(p) && (pte = clockscan(p, &handva)) != 0){
+			mem = P2V(PTE_ADDR(*pte));
+			*pte = e | (*pte & (PTE_U|PTE_W|PTE_COW));
+			if(p == myproc())
+				invlpg((char*)handva);
+			else
+				p->lastcpu = 0;
+			handpid = p->pid;
+			handva += PGSIZE;
+			release(&p->lock);
+			release(&ptable.lock);
+			return mem;
+		}
+		release(&p->lock);
+		handva = 0;
+		if((p = p->next) == 0)
+			p = ptable.list;
+	}
+	release(&ptable.lock);
+	return 0;
+}
+
+// The hand of ksmscan(): the next page it looks at is ksmva
+// of process ksmpid.
+static int ksmpid;
+static uint ksmva;
+static uint ksmtick;
+
+// May ksm.c change p's page table?  Not while p runs or is in
+// pagefault().  Sets *write if p's writable pages may be made
+// copy-on-write too: not while p is in a system call, which
+// may write to pages it made present with faultin().
+static int
+ksmok(struct proc *p, int *write)
+{
+	if(p->pgdir == 0 || p->infault ||
+	   (p->state != RUNNABLE && p->state != SLEEPING))
+		return 0;
+	*write = !p->insyscall;
+	return 1;
+}
+
+// Return process pid if ksm.c may change its page table, with
+// *write set as by ksmok(), or 0.  The process comes locked,
+// unless it is held, whose lock the caller holds already.
+// Caller holds ptable.lock.
+struct proc*
+ksmproc(int pid, struct proc *held, int *write)
+{
+	struct proc *p;
+
+	for(p = ptable.list; p; p = p->next){
+		if(p->pid != pid)
+			continue;
+		if(p == held)
+			return ksmok(p, write) ? p : 0;
+		acquire(&p->lock);
+		if(ksmok(p, write))
+			return p;
+		release(&p->lock);
+		return 0;
+	}
+	return 0;
+}
+
+// Has p opted any memory in to page merging?  A hint: p's
+// ranges may be changing.
+static int
+ksmwanted(struct proc *p)
+{
+	int i;
+
+	for(i = 0; i < NKSMRANGE; i++)
+		if(p->ksm[i].end != 0)
+			return 1;
+	return 0;
+}
+
+// The process after p for the hand of ksmscan(), which ends a
+// pass when it comes round to the start of the list.
+static struct proc*
+ksmnext(struct proc *p)
+{
+	ksmva = 0;
+	if((p = p->next) == 0){
+		ksmpass();
+		p = ptable.list;
+	}
+	return p;
+}
+
+// Hand the next KSMSCAN pages of the next process that has
+// opted in to page merging to ksmpages(), going on from where
+// the last call stopped.  Does nothing more than once a tick,
+// and nothing at all unless some process has opted in.
+// Called by the scheduler.
+void
+ksmscan(void)
+{
+	struct proc *p;
+	int n, write;
+
+	if(ksmtick == ticks || !ksmactive())
+		return;
+	acquire(&ptable.lock);
+	if(ksmtick == ticks){
+		release(&ptable.lock);
+		return;
+	}
+	ksmtick = ticks;
+	for(p = ptable.list; p; p = p->next)
+		if(p->pid == ksmpid)
+			break;
+	if(p == 0){
+		p = ptable.list;
+		ksmva = 0;
+	}
+	// Pass over processes that have opted nothing in without
+	// locking them.
+	for(n = ptable.nproc; n > 0 && !ksmwanted(p); n--)
+		p = ksmnext(p);
+	acquire(&p->lock);
+	n = KSMSCAN;
+	if(ksmok(p, &write) && ksmpages(p, &ksmva, &n, write)){
+		release(&p->lock);
+	} else {
+		release(&p->lock);
+		p = ksmnext(p);
+	}
+	ksmpid = p->pid;
+	release(&ptable.lock);
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -522,7 +1277,7 @@ procdump(void)
 	char *state;
 	uint pc[10];
 
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+	for(p = ptable.list; p; p = p->next){
 		if(p->state == UNUSED)
 			continue;
 		if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -8,6 +8,16 @@ struct cpu {
 	int ncli;                    // Depth of pushcli nesting.
 	int intena;                  // Were interrupts enabled before pushcli?
 	struct proc *proc;           // The process running on this cpu or null
+	pde_t *pgdir;                // Page table in %cr3, kept while idle
+	uint tlbflush;               // Loads of %cr3
+	uint tlbskip;                // Context switches that kept %cr3
+	struct spinlock rqlock;      // Protects the run queues
+	struct proc *rqhead[NMLFQ];  // RUNNABLE processes to run here, by level
+	struct proc *rqtail[NMLFQ];
+	struct proc *rqroot;         // Or, for SCHED_CFS, by vruntime
+	uint64 minvruntime;          // Of the processes run here, for SCHED_CFS
+	int rqlen;                   // Processes queued
+	uint steal;                  // Processes taken from other run queues
 };
 
 extern struct cpu cpus[NCPU];
@@ -33,8 +43,52 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Scheduling classes, chosen with make SCHED=...
+#define SCHED_RR    0  // round-robin, a tick at a time
+#define SCHED_MLFQ  1  // multi-level feedback queue
+#define SCHED_CFS   2  // fair shares of CPU time, weighted by nice
+
+// A range of user memory whose pages are read from a file
+// when first touched (see pagefault()).  The page at va gets
+// the file's bytes at off + (va - start), of which there are
+// filesz in all; the rest of the range is zero-filled.
+// A region may instead map a shared-memory object, whose
+// pages are all present while it is attached.
+// A slot with neither ip nor shm is unused.
+struct vma {
+	uint start;                  // Page-aligned
+	uint end;
+	struct inode *ip;
+	uint off;
+	uint filesz;
+	int flags;                   // VMA_* below
+	struct shm *shm;
+};
+
+#define VMA_WRITE  0x1  // pages are writable
+#define VMA_SHARED 0x2  // dirty pages are written back to the file
+#define VMA_MMAP   0x4  // made by mmap(), above p->sz
+
+// A range of user memory opted in to same-page merging by
+// madvise() (see ksm.c).  A slot with end 0 is unused.
+struct ksmrange {
+	uint start;                  // Page-aligned
+	uint end;
+};
+
+// A program image built by loadimage() for exec() and spawn().
+struct image {
+	pde_t *pgdir;
+	uint sz;
+	uint entry;                  // Initial %eip
+	uint sp;                     // Initial %esp, with argv pushed
+	struct vma vma[NVMA];
+	char name[16];
+};
+
 // Per-process state
 struct proc {
+	struct spinlock lock;        // Protects state, chan and run queue links
 	uint sz;                     // Size of process memory (bytes)
 	pde_t* pgdir;                // Page table
 	char *kstack;                // Bottom of kernel stack for this process
@@ -44,10 +98,30 @@ struct proc {
 	struct trapframe *tf;        // Trap frame for current syscall
 	struct context *context;     // swtch() here to run process
 	void *chan;                  // If non-zero, sleeping on chan
+	struct proc *sleepnext;      // Next in chan's sleepq bucket
 	int killed;                  // If non-zero, have been killed
 	struct file *ofile[NOFILE];  // Open files
 	struct inode *cwd;           // Current directory
+	struct vma vma[NVMA];        // File-backed memory
+	struct ksmrange ksm[NKSMRANGE];  // Memory opted in to page merging
+	uint hugefault;              // heap stretches moved into 4 MB pages
+	uint hugefail;               // 4 MB heap pages wanted but not available
+	uint hugesplit;              // 4 MB heap pages split into 4 KB pages
+	struct cpu *lastcpu;         // CPU that last loaded pgdir for us
+	struct cpu *cpu;             // CPU that last ran us
+	struct proc *rqnext;         // Next on a run queue
+	int nice;                    // NICEMIN..NICEMAX, set by setpriority()
+	int level;                   // Scheduling level, 0 runs first
+	int used;                    // Ticks run at this level
+	uint64 vruntime;             // Weighted cycles run, for SCHED_CFS
+	uint64 tscstart;             // When vruntime was last brought up to date
+	struct proc *rqleft;         // Children in a run queue tree
+	struct proc *rqright;
+	int rqheight;
+	int insyscall;               // In a system call (see evict())
+	int infault;                 // In pagefault()
 	char name[16];               // Process name (debugging)
+	struct proc *next;           // Next in the process table
 };
 
 // Process memory is laid out contiguously, low addresses first:
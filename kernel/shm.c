@@ -0,0 +1,127 @@
+// Shared-memory objects.
+//
+// An object is a set of zeroed physical pages named by an
+// integer key.  shmget() creates one, shmat() maps all of its
+// pages into the calling process above MMAPBASE, and shmdt()
+// unmaps them again.  Every mapping holds a reference to each
+// page (see kdup()), as does the object itself, so a page is
+// freed only when the object is gone and no page table maps it.
+// The object goes away when its last attachment is dropped,
+// by shmdt(), exec() or exit(); fork() attaches the child too.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "shm.h"
+
+struct {
+	struct spinlock lock;
+	struct shm shm[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+	initlock(&shmtable.lock, "shm");
+}
+
+static struct shm*
+shmlookup(int key)
+{
+	struct shm *s;
+
+	for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++)
+		if(s->npages > 0 && s->key == key)
+			return s;
+	return 0;
+}
+
+// Create object key of size bytes, unless it exists already.
+// Returns 0, or -1 if an existing object is smaller than size
+// or there is no room for a new one.
+int
+shmget(int key, uint size)
+{
+	struct shm *s, *free;
+	uint i, n;
+
+	n = PGROUNDUP(size) / PGSIZE;
+	if(n == 0 || n > SHMPAGES)
+		return -1;
+	acquire(&shmtable.lock);
+	if((s = shmlookup(key)) != 0){
+		release(&shmtable.lock);
+		return s->npages >= n ? 0 : -1;
+	}
+	free = 0;
+	for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++)
+		if(s->npages == 0){
+			free = s;
+			break;
+		}
+	if(free == 0){
+		release(&shmtable.lock);
+		return -1;
+	}
+	for(i = 0; i < n; i++){
+		if((free->pages[i] = kalloc_zeroed()) == 0){
+			while(i-- > 0)
+				kfree(free->pages[i]);
+			release(&shmtable.lock);
+			return -1;
+		}
+	}
+	free->key = key;
+	free->ref = 0;
+	free->npages = n;
+	release(&shmtable.lock);
+	return 0;
+}
+
+// Map object key into the current process.
+// Returns the address of the mapping, or -1.
+int
+shmat(int key)
+{
+	struct shm *s;
+	int va;
+
+	acquire(&shmtable.lock);
+	if((s = shmlookup(key)) == 0){
+		release(&shmtable.lock);
+		return -1;
+	}
+	s->ref++;
+	release(&shmtable.lock);
+	if((va = mapshm(s)) < 0)
+		shmput(s);
+	return va;
+}
+
+// Count another attachment of s, for fork().
+void
+shmdup(struct shm *s)
+{
+	acquire(&shmtable.lock);
+	s->ref++;
+	release(&shmtable.lock);
+}
+
+// Drop an attachment of s, destroying it with the last one.
+// The caller has already unmapped s.
+void
+shmput(struct shm *s)
+{
+	uint i;
+
+	acquire(&shmtable.lock);
+	if(--s->ref == 0){
+		for(i = 0; i < s->npages; i++)
+			kfree(s->pages[i]);
+		s->npages = 0;
+	}
+	release(&shmtable.lock);
+}
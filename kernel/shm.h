@@ -0,0 +1,7 @@
+// A shared-memory object (see shm.c).
+struct shm {
+	int key;
+	int ref;                  // attachments
+	uint npages;              // 0 if the slot is free
+	char *pages[SHMPAGES];
+};
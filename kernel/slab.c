@@ -0,0 +1,207 @@
+// Slab allocator for small fixed-size kernel objects.
+//
+// A cache hands out objects of a single size.  Objects are
+// carved out of pages (slabs) obtained from kalloc(); each slab
+// begins with a struct slab header followed by as many objects
+// as fit.  A freed object goes back to the slab whose header is
+// at the start of the object's page, and a slab whose objects
+// are all free goes back to kalloc().
+//
+// To keep the cache lock off the common path, every CPU has a
+// magazine: a small stack of free objects.  Allocation pops
+// from the magazine and freeing pushes onto it; only when the
+// magazine is empty or full does the CPU take the cache lock to
+// move half a magazine of objects from or to the slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NKMEMCACHE 16  // maximum number of caches
+#define MAGSIZE    16  // objects per CPU magazine
+
+struct slab {
+	struct slab *next;        // on the cache's partial or full list
+	struct slab *prev;
+	struct kmem_cache *cache;
+	void *free;               // free objects in this slab
+	uint inuse;               // objects handed out, magazines included
+};
+
+struct magazine {
+	int n;
+	void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+	struct spinlock lock;
+	char *name;
+	uint size;             // object size, rounded up to a word
+	uint perslab;          // objects per slab
+	struct slab partial;   // slabs with free objects
+	struct slab full;      // slabs with every object in use
+	struct magazine mag[NCPU];
+};
+
+// Caches are only created during boot, on the first CPU.
+struct {
+	int n;
+	struct kmem_cache cache[NKMEMCACHE];
+} kmemcaches;
+
+static void
+slabpush(struct slab *head, struct slab *s)
+{
+	s->next = head->next;
+	s->prev = head;
+	head->next->prev = s;
+	head->next = s;
+}
+
+static void
+slabremove(struct slab *s)
+{
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+}
+
+// Create a cache of objects of the given size.
+// Objects must fit in a page along with the slab header.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+	struct kmem_cache *c;
+
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if(size + sizeof(struct slab) > PGSIZE)
+		panic("kmem_cache_create: object too big");
+
+	if(kmemcaches.n >= NKMEMCACHE)
+		panic("kmem_cache_create: too many caches");
+	c = &kmemcaches.cache[kmemcaches.n++];
+
+	initlock(&c->lock, name);
+	c->name = name;
+	c->size = size;
+	c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+	c->partial.next = c->partial.prev = &c->partial;
+	c->full.next = c->full.prev = &c->full;
+	return c;
+}
+
+// Allocate a new slab for c and put it on the partial list.
+// Caller must hold c->lock.
+static struct slab*
+slabgrow(struct kmem_cache *c)
+{
+	struct slab *s;
+	char *obj;
+	uint i;
+
+	if((s = (struct slab*)kalloc()) == 0)
+		return 0;
+	s->cache = c;
+	s->inuse = 0;
+	s->free = 0;
+	obj = (char*)(s + 1) + (c->perslab - 1) * c->size;
+	for(i = 0; i < c->perslab; i++, obj -= c->size){
+		*(void**)obj = s->free;
+		s->free = obj;
+	}
+	slabpush(&c->partial, s);
+	return s;
+}
+
+// Fill magazine m halfway from c's slabs.
+// Caller must hold c->lock.
+static void
+magrefill(struct kmem_cache *c, struct magazine *m)
+{
+	struct slab *s;
+	void *obj;
+
+	while(m->n < MAGSIZE/2){
+		s = c->partial.next;
+		if(s == &c->partial && (s = slabgrow(c)) == 0)
+			break;
+		obj = s->free;
+		s->free = *(void**)obj;
+		s->inuse++;
+		if(s->free == 0){
+			slabremove(s);
+			slabpush(&c->full, s);
+		}
+		m->obj[m->n++] = obj;
+	}
+}
+
+// Return half of magazine m to c's slabs, releasing
+// slabs that become entirely free.
+// Caller must hold c->lock.
+static void
+magdrain(struct kmem_cache *c, struct magazine *m)
+{
+	struct slab *s;
+	void *obj;
+
+	while(m->n > MAGSIZE/2){
+		obj = m->obj[--m->n];
+		s = (struct slab*)PGROUNDDOWN((uint)obj);
+		if(s->free == 0){
+			slabremove(s);
+			slabpush(&c->partial, s);
+		}
+		*(void**)obj = s->free;
+		s->free = obj;
+		if(--s->inuse == 0){
+			slabremove(s);
+			kfree((char*)s);
+		}
+	}
+}
+
+// Allocate an object from c.  The object's contents are undefined.
+// Returns 0 if memory is exhausted.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct magazine *m;
+	void *obj;
+
+	pushcli();
+	m = &c->mag[cpuid()];
+	if(m->n == 0){
+		acquire(&c->lock);
+		magrefill(c, m);
+		release(&c->lock);
+	}
+	obj = 0;
+	if(m->n > 0)
+		obj = m->obj[--m->n];
+	popcli();
+	return obj;
+}
+
+// Free an object previously returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	struct magazine *m;
+
+	if(((struct slab*)PGROUNDDOWN((uint)obj))->cache != c)
+		panic("kmem_cache_free");
+
+	pushcli();
+	m = &c->mag[cpuid()];
+	if(m->n == MAGSIZE){
+		acquire(&c->lock);
+		magdrain(c, m);
+		release(&c->lock);
+	}
+	m->obj[m->n++] = obj;
+	popcli();
+}
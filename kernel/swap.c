@@ -0,0 +1,343 @@
+// Paging of anonymous user memory.
+//
+// When user memory runs out, swapout() picks a page with a
+// clock scan (see evict() and clockscan()), and replaces its PTE
+// with a non-present one that has PTE_SWAP set and the number
+// of a swap entry in place of the physical address.  The entry
+// says where the page went: into the compressed store in memory
+// (zram.c) if it compresses well, else to a slot of the swap
+// area on disk.  A fault on such a PTE calls swapin() to bring
+// it back.  fork() shares entries between parent and child, so
+// they are reference counted like pages.
+//
+// The swap area is the sb.nswap blocks that mkfs leaves after
+// the file system, from sb.swapstart, in slots of one page.
+// Swap I/O bypasses the buffer cache: the file system never
+// reads these blocks, and paging would only push its blocks out.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "kstat.h"
+#include "x86.h"
+
+#define PGBLOCKS  (PGSIZE / BSIZE)
+#define ENT(pte)  ((pte) >> PGSHIFT)
+
+// Where a page that was paged out is.
+struct swapent {
+	ushort ref;     // PTEs naming it (SE_COUNT), and SE_* flags
+	ushort len;     // compressed length, if SE_ZRAM
+	uint where;     // slot, if SE_DISK; else the kernel address
+};
+
+#define SE_BUSY   0x8000  // being paged out
+#define SE_ZRAM   0x4000  // compressed in memory
+#define SE_DISK   0x2000  // in a swap slot
+#define SE_COUNT  0x0fff
+// Neither SE_ZRAM nor SE_DISK: there was nowhere to put the
+// page, so it stays as it is in the page at where.
+
+struct {
+	struct spinlock lock;
+	uint dev;
+	uint start;               // first block of the swap area
+	uint nslot;               // 0 if there is no swap area
+	uint nextslot;            // where slotalloc() looks first
+	uint used;                // slots in use
+	uchar *slot;              // slot in use?  nslot of them
+	uint nent;                // nslot + 8*ZRAMPAGES, for 8:1 compression
+	uint nextent;             // where entalloc() looks first
+	struct swapent *ent;      // nent of them
+	uint pageout;
+	uint pagein;
+	uint fail;
+	uint zfault;
+	uint zfaultkc;
+	uint dfault;
+	uint dfaultkc;
+	struct buf buf;           // for swapio(), under buf.lock
+} swap;
+
+// Allocate a zeroed table of n entries of size bytes.
+// Returns 0 if there is no memory for it.
+static void*
+tablealloc(uint n, uint size)
+{
+	char *t;
+	int order;
+
+	for(order = 0; (PGSIZE << order) < n * size; order++)
+		;
+	if(order > MAXORDER || (t = kalloc_pages(order)) == 0)
+		return 0;
+	memset(t, 0, PGSIZE << order);
+	return t;
+}
+
+// Read the swap area's location from the superblock and
+// allocate the slot and entry tables to match its size.
+// Called by the first process, after fsinit().
+void
+swapinit(int dev)
+{
+	struct superblock sb;
+	uint max;
+
+	initlock(&swap.lock, "swap");
+	initsleeplock(&swap.buf.lock, "swapbuf");
+	zraminit();
+	readsb(dev, &sb);
+	swap.dev = dev;
+	swap.start = sb.swapstart;
+	swap.nslot = sb.nswap / PGBLOCKS;
+	max = (PGSIZE << MAXORDER) / sizeof(struct swapent) - 8*ZRAMPAGES;
+	if(swap.nslot > max)
+		swap.nslot = max;
+	swap.nent = swap.nslot + 8*ZRAMPAGES;
+	if((swap.ent = tablealloc(swap.nent, sizeof(struct swapent))) == 0 ||
+	   (swap.slot = tablealloc(swap.nslot, sizeof(uchar))) == 0){
+		cprintf("swap: no memory for tables\n");
+		swap.nslot = swap.nent = 0;
+		return;
+	}
+	if(swap.nslot > 0)
+		cprintf("swap: %d pages\n", swap.nslot);
+}
+
+// Bytes of swap space.
+uint
+swapsize(void)
+{
+	return swap.nslot * PGSIZE;
+}
+
+// Copy page mem to or from slot, one block at a time.
+static void
+swapio(uint slot, char *mem, int write)
+{
+	struct buf *b;
+	int i;
+
+	b = &swap.buf;
+	acquiresleep(&b->lock);
+	for(i = 0; i < PGBLOCKS; i++){
+		b->dev = swap.dev;
+		b->blockno = swap.start + slot*PGBLOCKS + i;
+		if(write){
+			memmove(b->data, mem + i*BSIZE, BSIZE);
+			b->flags = B_DIRTY;
+		} else
+			b->flags = 0;
+		iderw(b);
+		if(!write)
+			memmove(mem + i*BSIZE, b->data, BSIZE);
+	}
+	releasesleep(&b->lock);
+}
+
+// Allocate a slot.  Returns its number, or -1.
+static int
+slotalloc(void)
+{
+	uint i, s;
+
+	acquire(&swap.lock);
+	for(i = 0; i < swap.nslot; i++){
+		s = (swap.nextslot + i) % swap.nslot;
+		if(!swap.slot[s]){
+			swap.slot[s] = 1;
+			swap.nextslot = s + 1;
+			swap.used++;
+			release(&swap.lock);
+			return s;
+		}
+	}
+	release(&swap.lock);
+	return -1;
+}
+
+// Allocate an entry, with one reference, marked busy.
+static int
+entalloc(void)
+{
+	uint i, e;
+
+	acquire(&swap.lock);
+	for(i = 0; i < swap.nent; i++){
+		e = (swap.nextent + i) % swap.nent;
+		if(swap.ent[e].ref == 0){
+			swap.ent[e].ref = SE_BUSY | 1;
+			swap.nextent = e + 1;
+			release(&swap.lock);
+			return e;
+		}
+	}
+	release(&swap.lock);
+	return -1;
+}
+
+// Release what entry e holds, once it has no references
+// and is not busy.  Caller must hold swap.lock.
+static void
+entfree(struct swapent *e)
+{
+	if(e->ref & SE_ZRAM)
+		zfree((char*)e->where, e->len);
+	else if(e->ref & SE_DISK){
+		swap.slot[e->where] = 0;
+		swap.used--;
+	} else
+		kfree((char*)e->where);
+	e->ref = 0;
+}
+
+// Drop a reference to entry e.  Caller must hold swap.lock.
+static void
+entput(struct swapent *e)
+{
+	if((e->ref & SE_COUNT) == 0)
+		panic("entput");
+	e->ref--;
+	if((e->ref & (SE_COUNT|SE_BUSY)) == 0)
+		entfree(e);
+}
+
+// Page out one user page, or drop a cached file page that is not
+// mapped, to make room in memory.  May sleep.
+// Returns 0 if a page was freed, or went to grow the compressed
+// store, and -1 if none could be.
+int
+swapout(void)
+{
+	struct swapent *e;
+	char *mem, *z;
+	uint len, where;
+	int i, s, took, flag, r;
+
+	// Cached file pages that are not mapped go first.
+	if(pcreclaim() == 0)
+		return 0;
+	if((i = entalloc()) < 0 || (mem = evict((i << PGSHIFT) | PTE_SWAP)) == 0){
+		acquire(&swap.lock);
+		if(i >= 0)
+			swap.ent[i].ref = 0;
+		swap.fail++;
+		release(&swap.lock);
+		return -1;
+	}
+	e = &swap.ent[i];
+
+	// Others may change e's count meanwhile, but nothing else.
+	r = 0;
+	len = 0;
+	if((z = zput(mem, &len, &took)) != 0){
+		where = (uint)z;
+		flag = SE_ZRAM;
+		if(!took)  // else mem holds compressed pages now
+			kfree(mem);
+	} else if((s = slotalloc()) >= 0){
+		swapio(s, mem, 1);
+		kfree(mem);
+		where = s;
+		flag = SE_DISK;
+	} else {
+		where = (uint)mem;
+		flag = 0;
+		r = -1;
+	}
+
+	acquire(&swap.lock);
+	e->where = where;
+	e->len = len;
+	e->ref = (e->ref & ~SE_BUSY) | flag;
+	if(r < 0)
+		swap.fail++;
+	else
+		swap.pageout++;
+	if((e->ref & SE_COUNT) == 0)
+		entfree(e);  // freed while it was being paged out
+	wakeup(e);
+	release(&swap.lock);
+	return r;
+}
+
+// Bring the page that swap PTE pte names into mem, and drop
+// the PTE's reference to it.  May sleep.
+void
+swapin(pte_t pte, char *mem)
+{
+	struct swapent *e;
+	uint64 t;
+
+	e = &swap.ent[ENT(pte)];
+	acquire(&swap.lock);
+	while(e->ref & SE_BUSY)
+		sleep(e, &swap.lock);
+	release(&swap.lock);
+
+	// The PTE's reference keeps e from changing.
+	t = rdtsc();
+	if(e->ref & SE_ZRAM)
+		zget((char*)e->where, e->len, mem);
+	else if(e->ref & SE_DISK)
+		swapio(e->where, mem, 0);
+	else
+		memmove(mem, (char*)e->where, PGSIZE);
+	t = (rdtsc() - t) >> 10;
+
+	acquire(&swap.lock);
+	if(e->ref & SE_ZRAM){
+		swap.zfault++;
+		swap.zfaultkc += t;
+	} else if(e->ref & SE_DISK){
+		swap.dfault++;
+		swap.dfaultkc += t;
+	}
+	swap.pagein++;
+	entput(e);
+	release(&swap.lock);
+}
+
+// Another PTE names the same entry as pte, for fork().
+void
+swapdup(pte_t pte)
+{
+	acquire(&swap.lock);
+	swap.ent[ENT(pte)].ref++;
+	release(&swap.lock);
+}
+
+// A PTE naming an entry is going away.
+void
+swapfree(pte_t pte)
+{
+	acquire(&swap.lock);
+	entput(&swap.ent[ENT(pte)]);
+	release(&swap.lock);
+}
+
+void
+swapstat(struct swapstat *st)
+{
+	acquire(&swap.lock);
+	st->physpages = kpages;
+	st->slots = swap.nslot;
+	st->used = swap.used;
+	st->pageout = swap.pageout;
+	st->pagein = swap.pagein;
+	st->fail = swap.fail;
+	st->zfault = swap.zfault;
+	st->zfaultkc = swap.zfaultkc;
+	st->dfault = swap.dfault;
+	st->dfaultkc = swap.dfaultkc;
+	release(&swap.lock);
+	st->scanned = clockscanned;
+	zramstat(st);
+}
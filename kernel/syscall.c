@@ -3,6 +3,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
@@ -12,6 +13,10 @@
 // Arguments on the stack, from the user call to the C
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
+//
+// User memory may not be mapped yet (see pagefault()), so
+// the functions below fault it in before handing it to the
+// rest of the kernel.
 
 // Fetch the int at addr from the current process.
 int
@@ -21,6 +26,8 @@ fetchint(uint addr, int *ip)
 
 	if(addr >= curproc->sz || addr+4 > curproc->sz)
 		return -1;
+	if(faultin(addr, 4, 0) < 0)
+		return -1;
 	*ip = *(int*)(addr);
 	return 0;
 }
@@ -39,6 +46,8 @@ fetchstr(uint addr, char **pp)
 	*pp = (char*)addr;
 	ep = (char*)curproc->sz;
 	for(s = *pp; s < ep; s++){
+		if((s == *pp || (uint)s % PGSIZE == 0) && faultin((uint)s, 1, 0) < 0)
+			return -1;
 		if(*s == 0)
 			return s - *pp;
 	}
@@ -52,23 +61,38 @@ argint(int n, int *ip)
 	return fetchint((myproc()->tf->esp) + 4 + 4*n, ip);
 }
 
-// Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+static int
+fetchptr(int n, char **pp, int size, int write)
 {
 	int i;
-	struct proc *curproc = myproc();
 
 	if(argint(n, &i) < 0)
 		return -1;
-	if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+	if(size < 0 || !uvmvalid(myproc(), i, size))
+		return -1;
+	if(faultin(i, size, write) < 0)
 		return -1;
 	*pp = (char*)i;
 	return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes.  Check that the pointer
+// lies within the process address space.
+int
+argptr(int n, char **pp, int size)
+{
+	return fetchptr(n, pp, size, 0);
+}
+
+// Like argptr, for a block the kernel will write into,
+// which must also be writable by the process.
+int
+argptrw(int n, char **pp, int size)
+{
+	return fetchptr(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -103,6 +127,18 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_cpustat(void);
+extern int sys_memstat(void);
+extern int sys_spawn(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_swapstat(void);
+extern int sys_madvise(void);
+extern int sys_ksmstat(void);
+extern int sys_setpriority(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -126,6 +162,18 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_cpustat] sys_cpustat,
+[SYS_memstat] sys_memstat,
+[SYS_spawn]   sys_spawn,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_swapstat] sys_swapstat,
+[SYS_madvise] sys_madvise,
+[SYS_ksmstat] sys_ksmstat,
+[SYS_setpriority] sys_setpriority,
 };
 
 void
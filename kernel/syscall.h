@@ -20,3 +20,15 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_cpustat 22
+#define SYS_memstat 23
+#define SYS_spawn  24
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_shmget 27
+#define SYS_shmat  28
+#define SYS_shmdt  29
+#define SYS_swapstat 30
+#define SYS_madvise 31
+#define SYS_ksmstat 32
+#define SYS_setpriority 33
@@ -9,9 +9,9 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
@@ -73,7 +73,7 @@ sys_read(void)
 	int n;
 	char *p;
 
-	if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+	if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptrw(1, &p, n) < 0)
 		return -1;
 	return fileread(f, p, n);
 }
@@ -109,7 +109,7 @@ sys_fstat(void)
 	struct file *f;
 	struct stat *st;
 
-	if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+	if(argfd(0, 0, &f) < 0 || argptrw(1, (void*)&st, sizeof(*st)) < 0)
 		return -1;
 	return filestat(f, st);
 }
@@ -256,8 +256,10 @@ create(char *path, short type, short major, short minor)
 		return 0;
 	}
 
-	if((ip = ialloc(dp->dev, type)) == 0)
-		panic("create: ialloc");
+	if((ip = ialloc(dp->dev, type)) == 0){
+		iunlockput(dp);
+		return 0;
+	}
 
 	ilock(ip);
 	ip->major = major;
@@ -273,8 +275,18 @@ create(char *path, short type, short major, short minor)
 			panic("create dots");
 	}
 
-	if(dirlink(dp, name, ip->inum) < 0)
-		panic("create: dirlink");
+	if(dirlink(dp, name, ip->inum) < 0){
+		// name exists after all; dirlookup() had no memory for it.
+		if(type == T_DIR){
+			dp->nlink--;
+			iupdate(dp);
+		}
+		ip->nlink = 0;
+		iupdate(ip);
+		iunlockput(ip);
+		iunlockput(dp);
+		return 0;
+	}
 
 	iunlockput(dp);
 
@@ -392,19 +404,17 @@ sys_chdir(void)
 	return 0;
 }
 
-int
-sys_exec(void)
+// Fetch the null-terminated user argument vector at uargv
+// into argv, which has room for MAXARG pointers.
+static int
+fetchargv(uint uargv, char **argv)
 {
-	char *path, *argv[MAXARG];
 	int i;
-	uint uargv, uarg;
+	uint uarg;
 
-	if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
-		return -1;
-	}
-	memset(argv, 0, sizeof(argv));
+	memset(argv, 0, MAXARG*sizeof(argv[0]));
 	for(i=0;; i++){
-		if(i >= NELEM(argv))
+		if(i >= MAXARG)
 			return -1;
 		if(fetchint(uargv+4*i, (int*)&uarg) < 0)
 			return -1;
@@ -415,9 +425,41 @@ sys_exec(void)
 		if(fetchstr(uarg, &argv[i]) < 0)
 			return -1;
 	}
+	return 0;
+}
+
+int
+sys_exec(void)
+{
+	char *path, *argv[MAXARG];
+	uint uargv;
+
+	if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+		return -1;
+	}
+	if(fetchargv(uargv, argv) < 0)
+		return -1;
 	return exec(path, argv);
 }
 
+int
+sys_spawn(void)
+{
+	char *path, *argv[MAXARG];
+	int *fds, nfds;
+	uint uargv;
+
+	if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0 ||
+	   argint(2, (int*)&fds) < 0 || argint(3, &nfds) < 0)
+		return -1;
+	if(fds && (nfds < 0 || nfds > NOFILE ||
+	   argptr(2, (void*)&fds, nfds*sizeof(fds[0])) < 0))
+		return -1;
+	if(fetchargv(uargv, argv) < 0)
+		return -1;
+	return spawn(path, argv, fds, nfds);
+}
+
 int
 sys_pipe(void)
 {
@@ -425,7 +467,7 @@ sys_pipe(void)
 	struct file *rf, *wf;
 	int fd0, fd1;
 
-	if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+	if(argptrw(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
 		return -1;
 	if(pipealloc(&rf, &wf) < 0)
 		return -1;
@@ -441,3 +483,28 @@ sys_pipe(void)
 	fd[1] = fd1;
 	return 0;
 }
+
+int
+sys_mmap(void)
+{
+	struct file *f;
+	int addr, len, prot, flags, off;
+
+	// addr is only a hint, and is ignored.
+	if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+	   argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+		return -1;
+	if(len <= 0 || off < 0)
+		return -1;
+	return mmap(f, len, prot, flags, off);
+}
+
+int
+sys_munmap(void)
+{
+	int addr, len;
+
+	if(argint(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+		return -1;
+	return munmap(addr, len);
+}
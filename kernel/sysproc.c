@@ -5,7 +5,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
+#include "kstat.h"
+#include "timer.h"
 
 int
 sys_fork(void)
@@ -59,19 +62,23 @@ sys_sbrk(void)
 int
 sys_sleep(void)
 {
+	struct timer t;
 	int n;
-	uint ticks0;
 
 	if(argint(0, &n) < 0)
 		return -1;
+	if(n <= 0)
+		return 0;
+	// The timer wakes just us, once, when n ticks have passed.
 	acquire(&tickslock);
-	ticks0 = ticks;
-	while(ticks - ticks0 < n){
+	timeradd(&t, ticks + n, wakeup, &t);
+	while(timerpending(&t)){
 		if(myproc()->killed){
+			timerdel(&t);
 			release(&tickslock);
 			return -1;
 		}
-		sleep(&ticks, &tickslock);
+		sleep(&t, &tickslock);
 	}
 	release(&tickslock);
 	return 0;
@@ -89,3 +96,125 @@ sys_uptime(void)
 	release(&tickslock);
 	return xticks;
 }
+
+// Copy per-CPU statistics for up to n CPUs into the user array.
+// Returns the number of CPUs reported.
+int
+sys_cpustat(void)
+{
+	struct cpustat *st;
+	int i, n;
+
+	if(argint(1, &n) < 0 || n < 0)
+		return -1;
+	if(n > ncpu)
+		n = ncpu;
+	if(argptrw(0, (void*)&st, n*sizeof(*st)) < 0)
+		return -1;
+	for(i = 0; i < n; i++){
+		memset(&st[i], 0, sizeof(st[i]));
+		kallocstat(i, &st[i]);
+		st[i].tlb_flush = cpus[i].tlbflush;
+		st[i].tlb_skip = cpus[i].tlbskip;
+		st[i].rq_len = cpus[i].rqlen;
+		st[i].rq_steal = cpus[i].steal;
+	}
+	return n;
+}
+
+// Report the calling process's memory use.
+int
+sys_memstat(void)
+{
+	struct memstat *st;
+	struct proc *p;
+
+	if(argptrw(0, (void*)&st, sizeof(*st)) < 0)
+		return -1;
+	p = myproc();
+	uvmstat(p->pgdir, p->sz, st);
+	st->hugefault = p->hugefault;
+	st->hugefail = p->hugefail;
+	st->hugesplit = p->hugesplit;
+	return 0;
+}
+
+// Create shared-memory object key of at least size bytes.
+int
+sys_shmget(void)
+{
+	int key, size;
+
+	if(argint(0, &key) < 0 || argint(1, &size) < 0 || size <= 0)
+		return -1;
+	return shmget(key, size);
+}
+
+// Attach shared-memory object key; returns its address.
+int
+sys_shmat(void)
+{
+	int key;
+
+	if(argint(0, &key) < 0)
+		return -1;
+	return shmat(key);
+}
+
+// Detach the shared-memory object attached at addr.
+int
+sys_shmdt(void)
+{
+	int addr;
+
+	if(argint(0, &addr) < 0)
+		return -1;
+	return unmapshm(addr);
+}
+
+// Report system-wide paging activity.
+int
+sys_swapstat(void)
+{
+	struct swapstat *st;
+
+	if(argptrw(0, (void*)&st, sizeof(*st)) < 0)
+		return -1;
+	swapstat(st);
+	return 0;
+}
+
+// Opt a range of memory in to or out of same-page merging.
+int
+sys_madvise(void)
+{
+	int addr, len, advice;
+
+	if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0 ||
+	   len <= 0)
+		return -1;
+	return madvise(addr, len, advice);
+}
+
+// Report same-page merging activity.
+int
+sys_ksmstat(void)
+{
+	struct ksmstat *st;
+
+	if(argptrw(0, (void*)&st, sizeof(*st)) < 0)
+		return -1;
+	ksmstat(st);
+	return 0;
+}
+
+// Set the nice value of a process (see setpriority()).
+int
+sys_setpriority(void)
+{
+	int pid, nice;
+
+	if(argint(0, &pid) < 0 || argint(1, &nice) < 0)
+		return -1;
+	return setpriority(pid, nice);
+}
@@ -0,0 +1,144 @@
+// Timers: calls to be made from the clock interrupt.
+//
+// Pending timers are kept in a hierarchical timing wheel of
+// NWHEEL levels of WHEELSIZE slots.  Level 0 has a slot for
+// each of the next WHEELSIZE ticks; each slot of level i covers
+// WHEELSIZE times as many ticks as one of level i-1.  A tick
+// looks at one slot of level 0, and once every WHEELSIZE ticks
+// moves the timers of the next slot of level 1 down to level
+// 0, and so on up, so adding, cancelling and firing a timer all
+// take constant time, however many are pending.
+//
+// tickslock protects the wheel; timeradd() and timerdel()
+// callers hold it, and timertick() runs with it held.
+
+#include "types.h"
+#include "defs.h"
+#include "spinlock.h"
+#include "timer.h"
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define NWHEEL    4
+#define WHEELMAX  ((1U << (WHEELBITS*NWHEEL)) - 1)  // furthest reach, in ticks
+
+static struct {
+	struct timer *slot[NWHEEL][WHEELSIZE];
+	uint next;                // next tick timertick() looks at
+} wheel;
+
+// Put t in the slot of the wheel for t->when.
+static void
+enqueue(struct timer *t)
+{
+	struct timer **s;
+	uint d, when;
+	int i;
+
+	d = t->when - wheel.next;
+	when = t->when;
+	if((int)d < 0){
+		// Due already: fire on the next tick.
+		d = 0;
+		when = wheel.next;
+	} else if(d > WHEELMAX){
+		// Beyond the top level; park it as far out as the
+		// wheel reaches, and move it on from there.
+		d = WHEELMAX;
+		when = wheel.next + WHEELMAX;
+	}
+	for(i = 0; i < NWHEEL-1; i++)
+		if(d < (1U << (WHEELBITS*(i+1))))
+			break;
+	s = &wheel.slot[i][(when >> (WHEELBITS*i)) & (WHEELSIZE-1)];
+	t->next = *s;
+	if(t->next)
+		t->next->pprev = &t->next;
+	t->pprev = s;
+	*s = t;
+}
+
+static void
+dequeue(struct timer *t)
+{
+	*t->pprev = t->next;
+	if(t->next)
+		t->next->pprev = t->pprev;
+	t->pprev = 0;
+}
+
+// Call fn(arg) from the clock interrupt at tick when, or at the
+// next tick if when has passed.  fn runs holding tickslock,
+// and may take no locks but those that wakeup() takes.
+// Caller holds tickslock.
+void
+timeradd(struct timer *t, uint when, void (*fn)(void*), void *arg)
+{
+	if(!holding(&tickslock))
+		panic("timeradd");
+	t->when = when;
+	t->fn = fn;
+	t->arg = arg;
+	enqueue(t);
+}
+
+// Cancel t.  Returns 1 if it was pending, or 0 if it has fired
+// or was never added.  Caller holds tickslock.
+int
+timerdel(struct timer *t)
+{
+	if(!holding(&tickslock))
+		panic("timerdel");
+	if(t->pprev == 0)
+		return 0;
+	dequeue(t);
+	return 1;
+}
+
+// Is t still to fire?  Caller holds tickslock.
+int
+timerpending(struct timer *t)
+{
+	return t->pprev != 0;
+}
+
+// Move the timers of slot i of level l down the wheel.
+static void
+cascade(int l, int i)
+{
+	struct timer *t, *next;
+
+	t = wheel.slot[l][i];
+	wheel.slot[l][i] = 0;
+	for(; t; t = next){
+		next = t->next;
+		enqueue(t);
+	}
+}
+
+// Fire the timers due at each tick up to now.
+// Called by the clock interrupt, holding tickslock.
+void
+timertick(uint now)
+{
+	struct timer *t;
+	int i, l;
+
+	while((int)(now - wheel.next) >= 0){
+		i = wheel.next & (WHEELSIZE-1);
+		for(l = 1; i == 0 && l < NWHEEL; l++){
+			i = (wheel.next >> (WHEELBITS*l)) & (WHEELSIZE-1);
+			cascade(l, i);
+		}
+		while((t = wheel.slot[0][wheel.next & (WHEELSIZE-1)]) != 0){
+			dequeue(t);
+			if((int)(t->when - wheel.next) > 0){
+				// Parked beyond the wheel's reach.
+				enqueue(t);
+				continue;
+			}
+			t->fn(t->arg);
+		}
+		wheel.next++;
+	}
+}
@@ -0,0 +1,9 @@
+// A call to be made from the clock interrupt at a given tick
+// (see timer.c).
+struct timer {
+	uint when;                // tick at which to call fn
+	void (*fn)(void*);
+	void *arg;
+	struct timer *next;       // in a slot of the wheel
+	struct timer **pprev;     // 0 unless pending
+};
@@ -3,10 +3,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 gatedesc idt[256];
@@ -39,7 +39,9 @@ trap(struct trapframe *tf)
 		if(myproc()->killed)
 			exit();
 		myproc()->tf = tf;
+		myproc()->insyscall = 1;
 		syscall();
+		myproc()->insyscall = 0;
 		if(myproc()->killed)
 			exit();
 		return;
@@ -50,8 +52,10 @@ trap(struct trapframe *tf)
 		if(cpuid() == 0){
 			acquire(&tickslock);
 			ticks++;
-			wakeup(&ticks);
+			timertick(ticks);
 			release(&tickslock);
+			if(ticks % MLFQBOOST == 0)
+				mlfqboost();
 		}
 		lapiceoi();
 		break;
@@ -76,6 +80,14 @@ trap(struct trapframe *tf)
 			cpuid(), tf->cs, tf->eip);
 		lapiceoi();
 		break;
+	case T_PGFLT:
+		// Copy-on-write and other faults the VM system resolves.
+		// Only faults from user space: system calls make user
+		// memory present with faultin() before touching it, and
+		// pagefault() may sleep, so a fault in the kernel is a bug.
+		if(myproc() && (tf->cs&3) == DPL_USER && pagefault(rcr2(), tf->err) == 0)
+			break;
+		// fall through
 
 	default:
 		if(myproc() == 0 || (tf->cs&3) == 0){
@@ -98,11 +110,12 @@ trap(struct trapframe *tf)
 	if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
 		exit();
 
-	// Force process to give up CPU on clock tick.
+	// Charge the process for the clock tick, which may make it
+	// give up the CPU.
 	// If interrupts were on while locks held, would need to check nlock.
 	if(myproc() && myproc()->state == RUNNING &&
 			tf->trapno == T_IRQ0+IRQ_TIMER)
-		yield();
+		schedtick();
 
 	// Check if the process has been killed since we yielded
 	if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
@@ -4,8 +4,21 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "elf.h"
+#include "kstat.h"
+#include "stat.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "shm.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define BIGORDER (PDXSHIFT - PGSHIFT)  // kalloc_pages() order of a 4 MB page
+#define BIGFILL  (NPTENTRIES / 2)     // pages of a stretch that earn it a 4 MB page
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -32,20 +45,25 @@ seginit(void)
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
-static pte_t *
+pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
 	pde_t *pde;
 	pte_t *pgtab;
 
 	pde = &pgdir[PDX(va)];
+	if(*pde & PTE_PS){
+		// A 4 MB page has no PTEs; see splitbig().
+		if(alloc)
+			panic("walkpgdir: 4 MB page");
+		return 0;
+	}
 	if(*pde & PTE_P){
 		pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
 	} else {
-		if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
+		// kalloc_zeroed() makes sure all those PTE_P bits are zero.
+		if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
 			return 0;
-		// Make sure all those PTE_P bits are zero.
-		memset(pgtab, 0, PGSIZE);
 		// The permissions here are overly generous, but they can
 		// be further restricted by the permissions in the page table
 		// entries, if necessary.
@@ -92,13 +110,18 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
+// The kernel part is mapped with 4 MB pages where alignment allows,
+// and all of it is global (PTE_G), so its TLB entries survive the
+// lcr3 on every context switch.
+//
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop, found
+// from the BIOS memory map by kinit1())
+// (directly addressable from end..P2V(phystop)).
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -110,38 +133,99 @@ static struct kmap {
 } kmap[] = {
 	{ (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
 	{ (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
-	{ (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+	{ (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory
 	{ (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Like mappages, for the kernel part of kpgdir: use a 4 MB page
+// for each 4 MB-aligned stretch and 4 KB pages for the rest.
+// All mappings are global.
+static int
+kmappages(pde_t *pgdir, char *va, uint size, uint pa, int perm)
+{
+	uint n;
+
+	perm |= PTE_G;
+	while(size > 0){
+		if((uint)va % BIGPGSIZE == 0 && size >= BIGPGSIZE){
+			if(pgdir[PDX(va)] & PTE_P)
+				panic("remap");
+			pgdir[PDX(va)] = pa | perm | PTE_PS | PTE_P;
+			n = BIGPGSIZE;
+		} else {
+			n = BIGPGSIZE - (uint)va % BIGPGSIZE;
+			if(n > size)
+				n = size;
+			if(mappages(pgdir, va, n, pa, perm) < 0)
+				return -1;
+		}
+		va += n;
+		pa += n;
+		size -= n;
+	}
+	return 0;
+}
+
+// Set up kernel part of a page table.  The kernel's page tables
+// are built once, for kpgdir; every other page directory shares
+// them by copying kpgdir's entries above KERNBASE.
 pde_t*
 setupkvm(void)
 {
 	pde_t *pgdir;
-	struct kmap *k;
 
-	if((pgdir = (pde_t*)kalloc()) == 0)
+	if((pgdir = (pde_t*)kalloc_zeroed()) == 0)
 		return 0;
-	memset(pgdir, 0, PGSIZE);
-	if (P2V(PHYSTOP) > (void*)DEVSPACE)
-		panic("PHYSTOP too high");
-	for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-		if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-		            (uint)k->phys_start, k->perm) < 0) {
-			freevm(pgdir);
-			return 0;
-		}
+	memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+	        (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
 	return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes, and build the kernel mappings
+// that all page tables share.
 void
 kvmalloc(void)
 {
-	kpgdir = setupkvm();
-	switchkvm();
+	struct kmap *k;
+
+	// The direct map of physical memory ends at phystop,
+	// which is only known at run time.
+	kmap[2].phys_end = phystop;
+	if (P2V(phystop) > (void*)DEVSPACE)
+		panic("phystop too high");
+	if((kpgdir = (pde_t*)kalloc_zeroed()) == 0)
+		panic("kvmalloc: out of memory");
+	for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+		if(kmappages(kpgdir, k->virt, k->phys_end - k->phys_start,
+		             (uint)k->phys_start, k->perm) < 0)
+			panic("kvmalloc: out of memory");
+	// Not switchkvm(): mycpu() does not work before mpinit().
+	lcr3(V2P(kpgdir));
+}
+
+// Load pgdir into %cr3, flushing this CPU's non-global TLB
+// entries.  The scheduler leaves a process's page table loaded
+// after the process stops running, so a CPU holds a reference
+// (see kdup()) to the user page table it has loaded, and the
+// page directory is only freed once freevm() has been called
+// and no CPU has it loaded any more.
+// Caller must have interrupts off.
+static void
+loadpgdir(pde_t *pgdir)
+{
+	struct cpu *c;
+	pde_t *old;
+
+	c = mycpu();
+	if(pgdir != kpgdir)
+		kdup((char*)pgdir);
+	lcr3(V2P(pgdir));
+	c->tlbflush++;
+	old = c->pgdir;
+	c->pgdir = pgdir;
+	if(old && old != kpgdir)
+		kfree((char*)old);
 }
 
 // Switch h/w page table register to the kernel-only page table,
@@ -149,12 +233,15 @@ kvmalloc(void)
 void
 switchkvm(void)
 {
-	lcr3(V2P(kpgdir));   // switch to the kernel page table
+	pushcli();
+	loadpgdir(kpgdir);   // switch to the kernel page table
+	popcli();
 }
 
-// Switch TSS and h/w page table to correspond to process p.
-void
-switchuvm(struct proc *p)
+// Point this CPU's TSS at p's kernel stack.
+// Caller must have interrupts off.
+static void
+switchtss(struct proc *p)
 {
 	if(p == 0)
 		panic("switchuvm: no process");
@@ -163,7 +250,6 @@ switchuvm(struct proc *p)
 	if(p->pgdir == 0)
 		panic("switchuvm: no pgdir");
 
-	pushcli();
 	mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
 		sizeof(mycpu()->ts)-1, 0);
 	SEG_CLS(mycpu()->gdt[SEG_TSS]);
@@ -173,7 +259,38 @@ switchuvm(struct proc *p)
 	// forbids I/O instructions (e.g., inb and outb) from user space
 	mycpu()->ts.iomb = (ushort) 0xFFFF;
 	ltr(SEG_TSS << 3);
-	lcr3(V2P(p->pgdir));  // switch to process's address space
+}
+
+// Switch TSS and h/w page table to correspond to process p.
+// Always reloads %cr3, so it also flushes p's TLB entries.
+void
+switchuvm(struct proc *p)
+{
+	pushcli();
+	switchtss(p);
+	loadpgdir(p->pgdir);  // switch to process's address space
+	p->lastcpu = mycpu();
+	popcli();
+}
+
+// Like switchuvm, for the scheduler resuming p.  The scheduler
+// does not switch back to kpgdir, so %cr3 may still hold p's
+// page table; it is only reloaded if not, or if p has run on
+// another CPU since it last ran here, in which case this CPU's
+// TLB may hold entries that p has since changed.
+void
+resumeuvm(struct proc *p)
+{
+	struct cpu *c;
+
+	pushcli();
+	c = mycpu();
+	switchtss(p);
+	if(c->pgdir == p->pgdir && p->lastcpu == c)
+		c->tlbskip++;
+	else
+		loadpgdir(p->pgdir);
+	p->lastcpu = c;
 	popcli();
 }
 
@@ -186,36 +303,11 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
 	if(sz >= PGSIZE)
 		panic("inituvm: more than a page");
-	mem = kalloc();
-	memset(mem, 0, PGSIZE);
+	mem = kalloc_zeroed();
 	mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
 	memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
-{
-	uint i, pa, n;
-	pte_t *pte;
-
-	if((uint) addr % PGSIZE != 0)
-		panic("loaduvm: addr must be page aligned");
-	for(i = 0; i < sz; i += PGSIZE){
-		if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-			panic("loaduvm: address should exist");
-		pa = PTE_ADDR(*pte);
-		if(sz - i < PGSIZE)
-			n = sz - i;
-		else
-			n = PGSIZE;
-		if(readi(ip, P2V(pa), offset+i, n) != n)
-			return -1;
-	}
-	return 0;
-}
-
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -231,13 +323,12 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
 	a = PGROUNDUP(oldsz);
 	for(; a < newsz; a += PGSIZE){
-		mem = kalloc();
+		mem = kalloc_zeroed();
 		if(mem == 0){
 			cprintf("allocuvm out of memory\n");
 			deallocuvm(pgdir, newsz, oldsz);
 			return 0;
 		}
-		memset(mem, 0, PGSIZE);
 		if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
 			cprintf("allocuvm out of memory (2)\n");
 			deallocuvm(pgdir, newsz, oldsz);
@@ -248,10 +339,37 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 	return newsz;
 }
 
+// Replace the 4 MB user page that maps va in pgdir with a page
+// table of 4 KB pages over the same memory, which can then be
+// freed or shared one page at a time.
+// Returns -1 if there is no memory for the page table.
+static int
+splitbig(pde_t *pgdir, uint va)
+{
+	pde_t *pde;
+	pte_t *pgtab;
+	uint pa, flags, i;
+
+	pde = &pgdir[PDX(va)];
+	if((pgtab = (pte_t*)kalloc()) == 0)
+		return -1;
+	pa = PTE_ADDR(*pde);
+	flags = PTE_FLAGS(*pde) & ~PTE_PS;
+	for(i = 0; i < NPTENTRIES; i++)
+		pgtab[i] = (pa + i*PGSIZE) | flags;
+	*pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+	if(rcr3() == V2P(pgdir))
+		lcr3(V2P(pgdir));
+	if(myproc() && myproc()->pgdir == pgdir)
+		myproc()->hugesplit++;
+	return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a 4 MB
+// page that is only partly freed cannot be split.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
@@ -262,7 +380,16 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 		return oldsz;
 
 	a = PGROUNDUP(newsz);
+	if(a % BIGPGSIZE && (pgdir[PDX(a)] & PTE_PS) && splitbig(pgdir, a) < 0)
+		return oldsz;
 	for(; a  < oldsz; a += PGSIZE){
+		// Any 4 MB page left lies wholly inside [a, oldsz).
+		if(pgdir[PDX(a)] & PTE_PS){
+			kfree_pages(P2V(PTE_ADDR(pgdir[PDX(a)])), BIGORDER);
+			pgdir[PDX(a)] = 0;
+			a += BIGPGSIZE - PGSIZE;
+			continue;
+		}
 		pte = walkpgdir(pgdir, (char*)a, 0);
 		if(!pte)
 			a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
@@ -273,13 +400,19 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 			char *v = P2V(pa);
 			kfree(v);
 			*pte = 0;
+		} else if(*pte & PTE_SWAP){
+			swapfree(*pte);
+			*pte = 0;
 		}
 	}
 	return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel part belongs to kpgdir.
+// Other CPUs may still have pgdir loaded (see loadpgdir()),
+// so its user entries are cleared, and the page directory
+// itself is freed by whoever drops the last reference.
 void
 freevm(pde_t *pgdir)
 {
@@ -288,9 +421,10 @@ freevm(pde_t *pgdir)
 	if(pgdir == 0)
 		panic("freevm: no pgdir");
 	deallocuvm(pgdir, KERNBASE, 0);
-	for(i = 0; i < NPDENTRIES; i++){
+	for(i = 0; i < PDX(KERNBASE); i++){
 		if(pgdir[i] & PTE_P){
 			char * v = P2V(PTE_ADDR(pgdir[i]));
+			pgdir[i] = 0;
 			kfree(v);
 		}
 	}
@@ -310,57 +444,787 @@ clearpteu(pde_t *pgdir, char *uva)
 	*pte &= ~PTE_U;
 }
 
+// Share the pages of pgdir in [start, end) with d,
+// copy-on-write if cow is set.
+static int
+copyrange(pde_t *pgdir, pde_t *d, uint start, uint end, int cow)
+{
+	pte_t *pte, *npte;
+	uint pa, i;
+
+	for(i = start; i < end; i += PGSIZE){
+		// 4 MB pages are not shared; the parent's is split into
+		// 4 KB pages that are shared like any others.
+		if((pgdir[PDX(i)] & PTE_PS) && splitbig(pgdir, i) < 0)
+			return -1;
+		// Heap pages that were never touched have nothing to share.
+		if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+			i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+			continue;
+		}
+		if(*pte & PTE_SWAP){
+			if((npte = walkpgdir(d, (void*)i, 1)) == 0)
+				return -1;
+			*npte = *pte;
+			swapdup(*pte);
+			continue;
+		}
+		if(!(*pte & PTE_P))
+			continue;
+		if(cow && (*pte & PTE_W))
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+		pa = PTE_ADDR(*pte);
+		// The child writes back only what it dirties itself.
+		if(mappages(d, (void*)i, PGSIZE, pa, PTE_FLAGS(*pte) & ~PTE_D) < 0)
+			return -1;
+		kdup(P2V(pa));
+	}
+	return 0;
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child, including the mmap() regions in vma.
+// The pages themselves are shared copy-on-write: writable
+// pages become read-only with PTE_COW set in both page
+// tables, and the first write to one takes a page fault
+// that copies it.  Shared-memory pages and the pages of shared
+// file mappings stay writable.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, uint sz, struct vma *vma)
 {
 	pde_t *d;
-	pte_t *pte;
-	uint pa, i, flags;
-	char *mem;
+	struct vma *v;
 
 	if((d = setupkvm()) == 0)
 		return 0;
-	for(i = 0; i < sz; i += PGSIZE){
-		if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-			panic("copyuvm: pte should exist");
-		if(!(*pte & PTE_P))
-			panic("copyuvm: page not present");
-		pa = PTE_ADDR(*pte);
-		flags = PTE_FLAGS(*pte);
-		if((mem = kalloc()) == 0)
+	if(copyrange(pgdir, d, 0, sz, 1) < 0)
+		goto bad;
+	for(v = vma; v < &vma[NVMA]; v++)
+		if((v->flags & VMA_MMAP) &&
+		   copyrange(pgdir, d, v->start, v->end, v->shm == 0 && !(v->flags & VMA_SHARED)) < 0)
 			goto bad;
-		memmove(mem, (char*)P2V(pa), PGSIZE);
-		if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-			kfree(mem);
-			goto bad;
-		}
-	}
+	// Drop the parent's stale writable TLB entries.
+	if(rcr3() == V2P(pgdir))
+		lcr3(V2P(pgdir));
 	return d;
 
 bad:
+	if(rcr3() == V2P(pgdir))
+		lcr3(V2P(pgdir));
 	freevm(d);
 	return 0;
 }
 
+// Make the copy-on-write page that *pte maps writable,
+// copying it first if another page table still shares it.
+// The caller must flush the TLB entry.
+// If there is no memory for the copy, pages some memory out
+// and returns 1 without changing *pte, since the page may
+// have been paged out meanwhile; the caller should retry.
+// Returns -1 if no memory can be found.
+static int
+cowbreak(pte_t *pte)
+{
+	char *mem, *v;
+
+	v = P2V(PTE_ADDR(*pte));
+	if(krefs(v) > 1){
+		if((mem = kalloc()) == 0)
+			return swapout() < 0 ? -1 : 1;
+		memmove(mem, v, PGSIZE);
+		*pte = V2P(mem) | PTE_FLAGS(*pte);
+		kfree(v);
+	}
+	*pte = (*pte & ~PTE_COW) | PTE_W;
+	return 0;
+}
+
+// Return the region of vma[] that contains va, or 0.
+struct vma*
+findvma(struct vma *vma, uint va)
+{
+	struct vma *v;
+
+	for(v = vma; v < &vma[NVMA]; v++)
+		if((v->ip || v->shm) && va >= v->start && va < v->end)
+			return v;
+	return 0;
+}
+
+// Read the file contents of the page at va of region v into
+// mem, which is zeroed.  May sleep.
+static int
+vmaread(struct vma *v, char *mem, uint va)
+{
+	uint off, n;
+	int r;
+
+	off = va - v->start;
+	if(off >= v->filesz)
+		return 0;
+	n = v->filesz - off;
+	if(n > PGSIZE)
+		n = PGSIZE;
+	ilock(v->ip);
+	r = readi(v->ip, mem, v->off + off, n);
+	iunlock(v->ip);
+	// A mapped file may have shrunk since mmap(); the rest
+	// of the page stays zero.
+	if(r < 0 || (r != n && !(v->flags & VMA_MMAP)))
+		return -1;
+	return 0;
+}
+
+// The page at va of private region v from the file page cache
+// (see pcache.c), with a reference for the caller, or 0 if it
+// is not all file contents or cannot be had.  May sleep.
+static char*
+vmacached(struct vma *v, uint va)
+{
+	uint off, n;
+
+	off = va - v->start;
+	if(v->ip == 0 || (v->flags & VMA_SHARED) || off >= v->filesz)
+		return 0;
+	n = v->filesz - off;
+	if(n > PGSIZE)
+		n = PGSIZE;
+	return pcget(v->ip, v->off + off, n);
+}
+
+// Write the dirty pages of pgdir in [start, end) of shared
+// region v back to its file, through the log.  Bytes past
+// the current end of the file are not written.
+static void
+vmawriteback(pde_t *pgdir, struct vma *v, uint start, uint end)
+{
+	int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+	uint a, off, i, n;
+	pte_t *pte;
+	char *mem;
+
+	for(a = start; a < end; a += PGSIZE){
+		pte = walkpgdir(pgdir, (char*)a, 0);
+		if(pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_D))
+			continue;
+		mem = P2V(PTE_ADDR(*pte));
+		off = v->off + (a - v->start);
+		for(i = 0; i < PGSIZE; i += n){
+			n = PGSIZE - i;
+			if(n > max)
+				n = max;
+			begin_op();
+			ilock(v->ip);
+			if(off + i >= v->ip->size)
+				n = PGSIZE - i;
+			else {
+				if(n > v->ip->size - (off + i))
+					n = v->ip->size - (off + i);
+				writei(v->ip, mem + i, off + i, n);
+			}
+			iunlock(v->ip);
+			end_op();
+		}
+	}
+}
+
+// Write back the dirty pages of every shared region in vma,
+// whose pages are mapped in pgdir.  For exit() and exec().
+void
+vmaflush(pde_t *pgdir, struct vma *vma)
+{
+	struct vma *v;
+
+	for(v = vma; v < &vma[NVMA]; v++)
+		if(v->ip && (v->flags & VMA_SHARED))
+			vmawriteback(pgdir, v, v->start, v->end);
+}
+
+// Copy the regions in src to dst for fork().
+void
+vmadup(struct vma *dst, struct vma *src)
+{
+	int i;
+
+	for(i = 0; i < NVMA; i++){
+		dst[i] = src[i];
+		if(src[i].ip)
+			idup(src[i].ip);
+		if(src[i].shm)
+			shmdup(src[i].shm);
+	}
+}
+
+// Drop all regions in vma.  Must be called inside a
+// transaction, since it may put the last reference to an inode.
+void
+vmaclear(struct vma *vma)
+{
+	struct vma *v;
+
+	for(v = vma; v < &vma[NVMA]; v++){
+		if(v->ip)
+			iput(v->ip);
+		if(v->shm)
+			shmput(v->shm);
+		memset(v, 0, sizeof(*v));
+	}
+}
+
+// Does any region in vma overlap [start, end)?
+static int
+vmaoverlap(struct vma *vma, uint start, uint end)
+{
+	struct vma *v;
+
+	for(v = vma; v < &vma[NVMA]; v++)
+		if((v->ip || v->shm) && v->start < end && start < v->end)
+			return 1;
+	return 0;
+}
+
+// Return an unused slot in p->vma, or 0.
+static struct vma*
+vmaalloc(struct proc *p)
+{
+	struct vma *v;
+
+	for(v = p->vma; v < &p->vma[NVMA]; v++)
+		if(v->ip == 0 && v->shm == 0)
+			return v;
+	return 0;
+}
+
+// Find the lowest len bytes of p's address space above MMAPBASE
+// that no region uses.  Returns the start, or 0 if there is none.
+static uint
+vmaspace(struct proc *p, uint len)
+{
+	struct vma *v;
+	uint start;
+	int moved;
+
+	start = MMAPBASE;
+	do {
+		moved = 0;
+		for(v = p->vma; v < &p->vma[NVMA]; v++){
+			if((v->ip || v->shm) && v->start < start + len && start < v->end){
+				start = v->end;
+				moved = 1;
+			}
+		}
+	} while(moved);
+	if(start + len < start || start + len > KERNBASE)
+		return 0;
+	return start;
+}
+
+// Once the 4 MB-aligned stretch of p's heap around va is being
+// filled, with BIGFILL of its pages mapped, move it into a single
+// 4 MB page: copy the pages in, and put the 4 MB page in place of
+// the page table.  That is only done when the whole stretch lies
+// below p->sz, none of it is file-backed and every page mapped
+// in it is p's own and writable.  p must be the current process.
+// Returns 0 on success.
+static int
+mapbig(struct proc *p, uint va)
+{
+	pde_t *pde;
+	pte_t *pgtab;
+	uint base, i, n;
+	char *mem;
+
+	base = va & ~(BIGPGSIZE - 1);
+	pde = &p->pgdir[PDX(base)];
+	if(base + BIGPGSIZE > p->sz || !(*pde & PTE_P) || (*pde & PTE_PS) ||
+	   vmaoverlap(p->vma, base, base + BIGPGSIZE))
+		return -1;
+	pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
+	n = 0;
+	for(i = 0; i < NPTENTRIES; i++){
+		if(pgtab[i] == 0)
+			continue;
+		if((pgtab[i] & (PTE_P|PTE_W|PTE_U)) != (PTE_P|PTE_W|PTE_U) ||
+		   krefs(P2V(PTE_ADDR(pgtab[i]))) > 1)
+			return -1;
+		n++;
+	}
+	if(n < BIGFILL)
+		return -1;
+	if((mem = kalloc_pages(BIGORDER)) == 0){
+		p->hugefail++;
+		return -1;
+	}
+	for(i = 0; i < NPTENTRIES; i++){
+		if(pgtab[i] == 0){
+			memset(mem + i*PGSIZE, 0, PGSIZE);
+			continue;
+		}
+		memmove(mem + i*PGSIZE, P2V(PTE_ADDR(pgtab[i])), PGSIZE);
+		kfree(P2V(PTE_ADDR(pgtab[i])));
+	}
+	*pde = V2P(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+	kfree((char*)pgtab);
+	lcr3(V2P(p->pgdir));
+	p->hugefault++;
+	return 0;
+}
+
+// Cut the regions in vma back to a process size of sz, so
+// that memory regrown by sbrk() is zero-filled, not reread.
+// mmap() regions lie above sz and are left alone.
+void
+vmatrim(struct vma *vma, uint sz)
+{
+	struct vma *v;
+
+	sz = PGROUNDUP(sz);
+	for(v = vma; v < &vma[NVMA]; v++){
+		if(v->ip && !(v->flags & VMA_MMAP) && v->end > sz)
+			v->end = v->start > sz ? v->start : sz;
+	}
+}
+
+// Map len bytes of inode file f, from page-aligned offset off,
+// into the current process between MMAPBASE and KERNBASE.
+// Pages are read in by pagefault() when touched.  Returns the
+// address of the mapping, or -1.
+int
+mmap(struct file *f, uint len, int prot, int flags, uint off)
+{
+	struct proc *p;
+	struct vma *free;
+	uint start;
+
+	p = myproc();
+	if(f->type != FD_INODE || f->ip->type != T_FILE || len == 0 ||
+	   off % PGSIZE != 0 || !f->readable)
+		return -1;
+	if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+	   (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+		return -1;
+	if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+		return -1;
+	len = PGROUNDUP(len);
+	if((free = vmaalloc(p)) == 0 || (start = vmaspace(p, len)) == 0)
+		return -1;
+
+	ilock(f->ip);
+	free->filesz = off < f->ip->size ? f->ip->size - off : 0;
+	iunlock(f->ip);
+	if(free->filesz > len)
+		free->filesz = len;
+	free->start = start;
+	free->end = start + len;
+	free->off = off;
+	free->flags = VMA_MMAP;
+	if(prot & PROT_WRITE)
+		free->flags |= VMA_WRITE;
+	if(flags & MAP_SHARED)
+		free->flags |= VMA_SHARED;
+	free->ip = idup(f->ip);
+	return start;
+}
+
+// Remove the mappings of the current process in [addr, addr+len),
+// writing dirty shared pages back first.  Only mmap() regions can
+// be unmapped, in whole or in part; unmapping a hole succeeds.
+// Returns 0, or -1 on error.
+int
+munmap(uint addr, uint len)
+{
+	struct proc *p;
+	struct vma *v, *free;
+	uint start, end;
+
+	p = myproc();
+	len = PGROUNDUP(len);
+	if(addr % PGSIZE != 0 || len == 0 || addr < MMAPBASE ||
+	   addr + len < addr || addr + len > KERNBASE)
+		return -1;
+
+	// Find a slot first, in case a region is split in two.
+	free = vmaalloc(p);
+
+	for(v = p->vma; v < &p->vma[NVMA]; v++){
+		if(v->ip == 0 || !(v->flags & VMA_MMAP) ||
+		   v->end <= addr || addr + len <= v->start)
+			continue;
+		start = addr > v->start ? addr : v->start;
+		end = addr + len < v->end ? addr + len : v->end;
+		if(start > v->start && end < v->end && free == 0)
+			return -1;
+		if(v->flags & VMA_SHARED)
+			vmawriteback(p->pgdir, v, start, end);
+		deallocuvm(p->pgdir, end, start);
+		if(start > v->start && end < v->end){
+			*free = *v;
+			free->start = end;
+			free->off += end - v->start;
+			free->filesz -= min(free->filesz, end - v->start);
+			idup(free->ip);
+			free = 0;
+		}
+		if(start > v->start){
+			v->end = start;
+			v->filesz = min(v->filesz, start - v->start);
+		} else {
+			v->off += end - v->start;
+			v->filesz -= min(v->filesz, end - v->start);
+			v->start = end;
+		}
+		if(v->start >= v->end){
+			begin_op();
+			iput(v->ip);
+			end_op();
+			memset(v, 0, sizeof(*v));
+		}
+	}
+	switchuvm(p);
+	return 0;
+}
+
+// Map all pages of shared-memory object s, which the caller
+// has counted an attachment of, into the current process
+// above MMAPBASE.  Returns the address, or -1.
+int
+mapshm(struct shm *s)
+{
+	struct proc *p;
+	struct vma *v;
+	uint start, i;
+
+	p = myproc();
+	if((v = vmaalloc(p)) == 0 || (start = vmaspace(p, s->npages*PGSIZE)) == 0)
+		return -1;
+	for(i = 0; i < s->npages; i++){
+		if(mappages(p->pgdir, (char*)start + i*PGSIZE, PGSIZE,
+		            V2P(s->pages[i]), PTE_W|PTE_U) < 0){
+			deallocuvm(p->pgdir, start + i*PGSIZE, start);
+			return -1;
+		}
+		kdup(s->pages[i]);
+	}
+	memset(v, 0, sizeof(*v));
+	v->start = start;
+	v->end = start + s->npages*PGSIZE;
+	v->flags = VMA_MMAP|VMA_WRITE;
+	v->shm = s;
+	return start;
+}
+
+// Detach the shared-memory object mapped at addr in the
+// current process.  Returns 0, or -1 if there is none.
+int
+unmapshm(uint addr)
+{
+	struct proc *p;
+	struct vma *v;
+	struct shm *s;
+
+	p = myproc();
+	if((v = findvma(p->vma, addr)) == 0 || v->shm == 0 || v->start != addr)
+		return -1;
+	deallocuvm(p->pgdir, v->end, v->start);
+	s = v->shm;
+	memset(v, 0, sizeof(*v));
+	switchuvm(p);
+	shmput(s);
+	return 0;
+}
+
+// Allocate a page for user memory, zeroed if zero is set,
+// paging other pages out to make room if need be.
+// May sleep.
+static char*
+ualloc(int zero)
+{
+	char *mem;
+
+	while((mem = zero ? kalloc_zeroed() : kalloc()) == 0)
+		if(swapout() < 0)
+			return 0;
+	return mem;
+}
+
+static int
+fault(struct proc *p, uint va, uint err)
+{
+	struct vma *v;
+	pte_t *pte;
+	char *mem;
+	int perm, r;
+
+	if(va >= KERNBASE || (p->pgdir[PDX(va)] & PTE_PS))
+		return -1;
+	pte = walkpgdir(p->pgdir, (char*)va, 0);
+	if(pte && (*pte & PTE_SWAP)){
+		if((mem = ualloc(0)) == 0)
+			goto oom;
+		swapin(*pte, mem);
+		perm = PTE_U;
+		if(*pte & (PTE_W|PTE_COW))
+			perm |= PTE_W;
+		*pte = V2P(mem) | perm | PTE_P;
+		return 0;
+	}
+	if(pte == 0 || !(*pte & PTE_P)){
+		va = PGROUNDDOWN(va);
+		v = findvma(p->vma, va);
+		if(va >= PGROUNDUP(p->sz) && (v == 0 || !(v->flags & VMA_MMAP)))
+			return -1;
+		if(v && v->shm)
+			return -1;
+		// The page table may need memory too.
+		while(pte == 0 && (pte = walkpgdir(p->pgdir, (char*)va, 1)) == 0)
+			if(swapout() < 0)
+				goto oom;
+		if(v != 0 && (v->flags & VMA_SHARED)){
+			if((mem = pcshared(v->ip, v->off + (va - v->start))) == 0)
+				goto oom;
+			perm = PTE_U;
+			if(v->flags & VMA_WRITE)
+				perm |= PTE_W;
+		} else if(v != 0 && (mem = vmacached(v, va)) != 0){
+			perm = PTE_U;
+			if(v->flags & VMA_WRITE)
+				perm |= PTE_COW;
+		} else {
+			if((mem = ualloc(1)) == 0)
+				goto oom;
+			if(v != 0 && vmaread(v, mem, va) < 0){
+				kfree(mem);
+				return -1;
+			}
+			perm = PTE_U;
+			if(v == 0 || (v->flags & VMA_WRITE))
+				perm |= PTE_W;
+		}
+		if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), perm) < 0){
+			kfree(mem);
+			return -1;
+		}
+		// Counting a stretch's pages reads its whole page
+		// table, so only look every so often.
+		if(v == 0 && PTX(va) % 64 == 0)
+			mapbig(p, va);
+		return 0;
+	}
+	if((err & FEC_WR) && (*pte & PTE_COW)){
+		if((r = cowbreak(pte)) < 0)
+			return -1;
+		if(r == 0)
+			invlpg((char*)va);
+		return 0;
+	}
+	return -1;
+
+oom:
+	cprintf("pid %d %s: out of memory\n", p->pid, p->name);
+	return -1;
+}
+
+// Handle a page fault at va in the current process, with
+// error code err.  Returns 0 if the faulting access can be
+// retried, or -1 if it is a genuine fault.
+//
+// exec() and sbrk() only reserve address space, so a missing
+// page below p->sz is touched for the first time.  If it lies
+// in one of p->vma[], it is read from the file, or taken from
+// the file page cache: shared copy-on-write for private regions,
+// and the one page all mappers share for shared regions.  It is
+// zero-filled otherwise.  A heap stretch that fills up is moved
+// into a 4 MB page.  A page that was paged out is read back from
+// swap.  Reading may sleep.
+//
+// While this runs, p->infault keeps other processes' calls
+// to evict() away from p's page table.
+int
+pagefault(uint va, uint err)
+{
+	struct proc *p;
+	int r;
+
+	p = myproc();
+	p->infault++;
+	r = fault(p, va, err);
+	p->infault--;
+	return r;
+}
+
+// Make sure the current process's pages covering [va, va+n)
+// are present, and writable if write is set, so that the
+// kernel can use them without taking a fault, possibly while
+// holding a lock.
+// Returns -1 if one of them cannot be brought in.
+int
+faultin(uint va, uint n, int write)
+{
+	pte_t *pte;
+	uint a, last;
+
+	if(n == 0)
+		return 0;
+	a = PGROUNDDOWN(va);
+	last = PGROUNDDOWN(va + n - 1);
+	for(;;){
+		// pagefault() may only make room and ask to be retried.
+		while(!(myproc()->pgdir[PDX(a)] & PTE_PS)){
+			pte = walkpgdir(myproc()->pgdir, (char*)a, 0);
+			if(pte == 0 || !(*pte & PTE_P)){
+				if(pagefault(a, 0) < 0)
+					return -1;
+			} else if(write && !(*pte & PTE_W)){
+				if(pagefault(a, FEC_P|FEC_WR) < 0)
+					return -1;
+			} else
+				break;
+		}
+		if(a == last)
+			break;
+		a += PGSIZE;
+	}
+	return 0;
+}
+
+// Is [va, va+n) user memory of p: below p->sz, or inside
+// one of its mmap() regions?
+int
+uvmvalid(struct proc *p, uint va, uint n)
+{
+	struct vma *v;
+
+	if(va + n < va)
+		return 0;
+	if(va + n <= p->sz)
+		return 1;
+	v = findvma(p->vma, va);
+	return v != 0 && (v->flags & VMA_MMAP) && va + n <= v->end;
+}
+
+uint clockscanned;  // PTEs looked at by clockscan()
+
+// Look for a page of p to page out, among its pages in [*va, p->sz),
+// giving each a second chance: a page with PTE_A set only has
+// the bit cleared.  Pages shared with another page table and
+// 4 MB pages are passed over.  Returns the PTE of the page
+// chosen, with *va set to its address, or 0 if the scan reached
+// p->sz.  Caller must hold p->lock, and p must not be using
+// its page table (see evict()).
+pte_t*
+clockscan(struct proc *p, uint *va)
+{
+	pte_t *pte;
+	uint a;
+
+	for(a = PGROUNDUP(*va); a < p->sz; a += PGSIZE){
+		if((p->pgdir[PDX(a)] & PTE_PS) ||
+		   (pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0){
+			a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+			continue;
+		}
+		clockscanned++;
+		// The page below the stack has no PTE_U.
+		if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+			continue;
+		if(*pte & PTE_A){
+			*pte &= ~PTE_A;
+			if(p == myproc())
+				invlpg((char*)a);
+			else
+				p->lastcpu = 0;
+			continue;
+		}
+		if(krefs(P2V(PTE_ADDR(*pte))) > 1)
+			continue;
+		*va = a;
+		return pte;
+	}
+	*va = a;
+	return 0;
+}
+
+// Report the memory use of the address space pgdir of size sz.
+void
+uvmstat(pde_t *pgdir, uint sz, struct memstat *st)
+{
+	pte_t *pgtab;
+	uint i, j;
+
+	st->sz = sz;
+	st->resident = st->huge = st->swapped = st->shared = 0;
+	for(i = 0; i < PDX(KERNBASE); i++){
+		if(pgdir[i] & PTE_PS){
+			st->resident += BIGPGSIZE;
+			st->huge += BIGPGSIZE;
+		} else if(pgdir[i] & PTE_P){
+			pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[i]));
+			for(j = 0; j < NPTENTRIES; j++){
+				if(pgtab[j] & PTE_P){
+					st->resident += PGSIZE;
+					if(krefs(P2V(PTE_ADDR(pgtab[j]))) > 1)
+						st->shared += PGSIZE;
+				} else if(pgtab[j] & PTE_SWAP)
+					st->swapped += PGSIZE;
+			}
+		}
+	}
+}
+
 // Map user virtual address to kernel address.
 char*
 uva2ka(pde_t *pgdir, char *uva)
 {
 	pte_t *pte;
+	pde_t pde;
 
+	pde = pgdir[PDX(uva)];
+	if(pde & PTE_PS){
+		// Not the kernel's own 4 MB pages.
+		if((pde & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+			return 0;
+		return (char*)P2V(PTE_ADDR(pde)) + ((uint)uva & (BIGPGSIZE-1));
+	}
 	pte = walkpgdir(pgdir, uva, 0);
-	if((*pte & PTE_P) == 0)
+	if(pte == 0 || (*pte & PTE_P) == 0)
 		return 0;
 	if((*pte & PTE_U) == 0)
 		return 0;
 	return (char*)P2V(PTE_ADDR(*pte));
 }
 
+// Like uva2ka, but for writing: a copy-on-write page is
+// given its own copy first.
+static char*
+uva2kawrite(pde_t *pgdir, char *uva)
+{
+	pte_t *pte;
+	int r;
+
+	if(pgdir[PDX(uva)] & PTE_PS)
+		return uva2ka(pgdir, uva);
+	pte = walkpgdir(pgdir, uva, 0);
+	for(;;){
+		if(pte == 0 || (*pte & PTE_P) == 0 || (*pte & PTE_U) == 0)
+			return 0;
+		if((*pte & PTE_COW) == 0)
+			break;
+		// cowbreak() returns 1 after paging memory out, maybe
+		// this page; look again.
+		if((r = cowbreak(pte)) < 0)
+			return 0;
+		if(r == 0){
+			if(rcr3() == V2P(pgdir))
+				invlpg(uva);
+			break;
+		}
+	}
+	return (char*)P2V(PTE_ADDR(*pte));
+}
+
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
-// uva2ka ensures this only works for PTE_U pages.
+// uva2kawrite ensures this only works for PTE_U pages.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
@@ -370,7 +1234,7 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 	buf = (char*)p;
 	while(len > 0){
 		va0 = (uint)PGROUNDDOWN(va);
-		pa0 = uva2ka(pgdir, (char*)va0);
+		pa0 = uva2kawrite(pgdir, (char*)va0);
 		if(pa0 == 0)
 			return -1;
 		n = PGSIZE - (va - va0);
@@ -140,12 +140,35 @@ lcr3(uint val)
 	asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+	uint val;
+	asm volatile("movl %%cr3,%0" : "=r" (val));
+	return val;
+}
+
+static inline void
+invlpg(void *addr)
+{
+	asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
 static inline void
 hlt(void)
 {
 	asm volatile("hlt");
 }
 
+static inline uint64
+rdtsc(void)
+{
+	uint lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64)hi << 32) | lo;
+}
+
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().
 struct trapframe {
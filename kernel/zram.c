@@ -0,0 +1,311 @@
+// Compressed store for paged-out user pages.
+//
+// swapout() offers each page it evicts to zput() before
+// writing it to disk.  A page that compresses to half its size
+// or less is kept here instead, and zget() decompresses it on
+// the fault that brings it back.
+//
+// The compressor is a small LZ77 coder in the manner of LZ4:
+// a sequence is a token byte holding a literal count and a
+// match length in its two nibbles (15 meaning more length
+// bytes follow, each added in until one is not 255), the
+// literals, then a two-byte match offset.  The last sequence
+// has literals only.  Matches are found through a hash table
+// of recent 4-byte strings, without searching further.
+//
+// Compressed pages live in store pages taken from kalloc() as
+// needed, split into GRAIN-byte granules that are handed out
+// first fit.  A store page goes back to kalloc() when it empties.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "kstat.h"
+
+#define GRAIN     64
+#define NGRAIN    (PGSIZE / GRAIN)
+#define ZMAX      (PGSIZE / 2)       // largest compressed page kept
+#define MINMATCH  4
+#define HASHBITS  10
+
+struct zpage {
+	char *mem;                // 0 if unused
+	uint map[NGRAIN / 32];    // granules in use
+};
+
+struct {
+	struct spinlock lock;
+	struct zpage page[ZRAMPAGES];
+	uint npages;              // store pages in use
+	uint nobj;                // pages held
+	uint bytes;               // their compressed size
+	uint reject;              // pages that did not compress enough
+	uchar buf[ZMAX];          // compressor output
+	ushort hash[1 << HASHBITS];  // position + 1 of a recent string
+} zram;
+
+void
+zraminit(void)
+{
+	initlock(&zram.lock, "zram");
+}
+
+static uint
+load32(uchar *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+// Append the rest of a nibble's length n (n >= 15) at dst[op].
+static int
+putlen(uchar *dst, int op, int max, int n)
+{
+	for(n -= 15; n >= 255; n -= 255){
+		if(op >= max)
+			return -1;
+		dst[op++] = 255;
+	}
+	if(op >= max)
+		return -1;
+	dst[op++] = n;
+	return op;
+}
+
+// Append a sequence of nlit literals from lit and, if mlen is
+// non-zero, a match of mlen bytes at distance off.
+// Returns the new output length, or -1 if it does not fit.
+static int
+putseq(uchar *dst, int op, int max, uchar *lit, int nlit, int off, int mlen)
+{
+	int tok;
+
+	tok = (nlit < 15 ? nlit : 15) << 4;
+	if(mlen)
+		tok |= mlen - MINMATCH < 15 ? mlen - MINMATCH : 15;
+	if(op >= max)
+		return -1;
+	dst[op++] = tok;
+	if(nlit >= 15 && (op = putlen(dst, op, max, nlit)) < 0)
+		return -1;
+	if(op + nlit > max)
+		return -1;
+	memmove(dst + op, lit, nlit);
+	op += nlit;
+	if(mlen == 0)
+		return op;
+	if(op + 2 > max)
+		return -1;
+	dst[op++] = off;
+	dst[op++] = off >> 8;
+	if(mlen - MINMATCH >= 15)
+		op = putlen(dst, op, max, mlen - MINMATCH);
+	return op;
+}
+
+// Compress the page at src into dst, which has room for max
+// bytes.  Returns the compressed length, or 0 if it is longer.
+static int
+lzcompress(uchar *src, uchar *dst, int max)
+{
+	int ip, anchor, op, ref, len;
+	uint v, h;
+
+	memset(zram.hash, 0, sizeof(zram.hash));
+	ip = anchor = op = 0;
+	while(ip + MINMATCH <= PGSIZE){
+		v = load32(src + ip);
+		h = (v * 2654435761U) >> (32 - HASHBITS);
+		ref = zram.hash[h] - 1;
+		zram.hash[h] = ip + 1;
+		if(ref < 0 || load32(src + ref) != v){
+			ip++;
+			continue;
+		}
+		for(len = MINMATCH; ip + len < PGSIZE && src[ref + len] == src[ip + len]; len++)
+			;
+		op = putseq(dst, op, max, src + anchor, ip - anchor, ip - ref, len);
+		if(op < 0)
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+	op = putseq(dst, op, max, src + anchor, PGSIZE - anchor, 0, 0);
+	return op < 0 ? 0 : op;
+}
+
+// Read a nibble's extra length bytes from src[*ip].
+static int
+getlen(uchar *src, int *ip)
+{
+	int n, b;
+
+	n = 0;
+	do {
+		b = src[(*ip)++];
+		n += b;
+	} while(b == 255);
+	return n;
+}
+
+static void
+lzdecompress(uchar *src, int n, uchar *dst)
+{
+	int ip, op, tok, lit, len, off;
+
+	ip = op = 0;
+	while(ip < n){
+		tok = src[ip++];
+		lit = tok >> 4;
+		if(lit == 15)
+			lit += getlen(src, &ip);
+		if(op + lit > PGSIZE)
+			panic("lzdecompress");
+		memmove(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+		if(ip >= n)
+			break;
+		off = src[ip] | src[ip+1] << 8;
+		ip += 2;
+		len = (tok & 15) + MINMATCH;
+		if((tok & 15) == 15)
+			len += getlen(src, &ip);
+		if(off == 0 || off > op || op + len > PGSIZE)
+			panic("lzdecompress");
+		for(; len > 0; len--, op++)
+			dst[op] = dst[op - off];
+	}
+	if(op != PGSIZE)
+		panic("lzdecompress: short");
+}
+
+static int
+granused(struct zpage *zp, int i)
+{
+	return zp->map[i / 32] & (1 << (i % 32));
+}
+
+// Find n free granules in a row in zp.  Returns the first, or -1.
+static int
+granfind(struct zpage *zp, int n)
+{
+	int i, run;
+
+	run = 0;
+	for(i = 0; i < NGRAIN; i++){
+		run = granused(zp, i) ? 0 : run + 1;
+		if(run == n)
+			return i - n + 1;
+	}
+	return -1;
+}
+
+static void
+granmark(struct zpage *zp, int first, int n, int used)
+{
+	int i;
+
+	for(i = first; i < first + n; i++){
+		if(used)
+			zp->map[i / 32] |= 1 << (i % 32);
+		else
+			zp->map[i / 32] &= ~(1 << (i % 32));
+	}
+}
+
+// Compress page and keep it in the store.  If the store needs
+// another page and none is free, page itself becomes one and
+// *took is set; otherwise page is left to the caller.
+// Returns the compressed copy with its length in *len, or 0
+// if the page does not compress well or the store is full.
+char*
+zput(char *page, uint *len, int *took)
+{
+	struct zpage *zp, *free;
+	int n, g, first;
+	char *z;
+
+	*took = 0;
+	acquire(&zram.lock);
+	if((n = lzcompress((uchar*)page, zram.buf, ZMAX)) == 0){
+		zram.reject++;
+		release(&zram.lock);
+		return 0;
+	}
+	g = (n + GRAIN - 1) / GRAIN;
+	free = 0;
+	first = -1;
+	for(zp = zram.page; zp < &zram.page[ZRAMPAGES]; zp++){
+		if(zp->mem == 0){
+			if(free == 0)
+				free = zp;
+		} else if((first = granfind(zp, g)) >= 0)
+			break;
+	}
+	if(first < 0){
+		if(free == 0){
+			release(&zram.lock);
+			return 0;
+		}
+		zp = free;
+		if((zp->mem = kalloc()) == 0){
+			zp->mem = page;
+			*took = 1;
+		}
+		memset(zp->map, 0, sizeof(zp->map));
+		zram.npages++;
+		first = 0;
+	}
+	granmark(zp, first, g, 1);
+	z = zp->mem + first * GRAIN;
+	memmove(z, zram.buf, n);
+	zram.nobj++;
+	zram.bytes += n;
+	release(&zram.lock);
+	*len = n;
+	return z;
+}
+
+// Decompress z, of length len, into page.
+void
+zget(char *z, uint len, char *page)
+{
+	lzdecompress((uchar*)z, len, (uchar*)page);
+}
+
+// Drop the compressed page z of length len from the store.
+void
+zfree(char *z, uint len)
+{
+	struct zpage *zp;
+
+	acquire(&zram.lock);
+	for(zp = zram.page; zp < &zram.page[ZRAMPAGES]; zp++)
+		if(zp->mem == (char*)PGROUNDDOWN((uint)z))
+			break;
+	if(zp == &zram.page[ZRAMPAGES])
+		panic("zfree");
+	granmark(zp, (z - zp->mem) / GRAIN, (len + GRAIN - 1) / GRAIN, 0);
+	if(granfind(zp, NGRAIN) == 0){
+		kfree(zp->mem);
+		zp->mem = 0;
+		zram.npages--;
+	}
+	zram.nobj--;
+	zram.bytes -= len;
+	release(&zram.lock);
+}
+
+// Report the store's use.
+void
+zramstat(struct swapstat *st)
+{
+	acquire(&zram.lock);
+	st->zstored = zram.nobj;
+	st->zbytes = zram.bytes;
+	st->zpages = zram.npages;
+	st->zreject = zram.reject;
+	release(&zram.lock);
+}
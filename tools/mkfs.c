@@ -18,7 +18,7 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks | swap ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
@@ -178,6 +178,8 @@ main(int argc, char *argv[])
 	sb.logstart = xint(2);
 	sb.inodestart = xint(2+nlog);
 	sb.bmapstart = xint(2+nlog+ninodeblocks);
+	sb.swapstart = xint(FSSIZE);
+	sb.nswap = xint(SWAPSIZE);
 
 	printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
 	        nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -186,6 +188,8 @@ main(int argc, char *argv[])
 
 	for(i = 0; i < FSSIZE; i++)
 		wsect(i, zeroes);
+	// The swap area needs no contents, only room.
+	wsect(FSSIZE + SWAPSIZE - 1, zeroes);
 
 	memset(buf, 0, sizeof(buf));
 	memmove(buf, &sb, sizeof(sb));
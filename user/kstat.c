@@ -0,0 +1,51 @@
+// Print the kernel's per-CPU statistics.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/kstat.h"
+#include "user.h"
+
+int
+main(void)
+{
+	struct cpustat st[NCPU];
+	struct swapstat ss;
+	struct ksmstat ks;
+	int i, n;
+
+	if((n = cpustat(st, NCPU)) < 0){
+		fprintf(2, "kstat: cpustat failed\n");
+		exit();
+	}
+	printf("cpu  kalloc-hit  refill  steal  drain  cached  zero-hit  zero-miss  zero-fill  cr3-load  cr3-kept  runq  rq-steal\n");
+	for(i = 0; i < n; i++)
+		printf("%d    %d  %d  %d  %d  %d  %d  %d  %d  %d  %d  %d  %d\n", i, st[i].kalloc_hit,
+			st[i].kalloc_refill, st[i].kalloc_steal,
+			st[i].kfree_drain, st[i].kcache_pages,
+			st[i].kzalloc_hit, st[i].kzalloc_miss, st[i].kzero_fill,
+			st[i].tlb_flush, st[i].tlb_skip, st[i].rq_len, st[i].rq_steal);
+	if(swapstat(&ss) < 0){
+		fprintf(2, "kstat: swapstat failed\n");
+		exit();
+	}
+	printf("swap: %d/%d pages used, %d out, %d in, %d scanned, %d failed; %d pages of memory\n",
+		ss.used, ss.slots, ss.pageout, ss.pagein, ss.scanned,
+		ss.fail, ss.physpages);
+	if(ss.zstored > 0)
+		printf("zram: %d pages in %d bytes (%d pages of memory), %d rejected\n",
+			ss.zstored, ss.zbytes, ss.zpages, ss.zreject);
+	if(ss.zfault > 0)
+		printf("zram: %d faults, %d Kcycles each\n", ss.zfault, ss.zfaultkc / ss.zfault);
+	if(ss.dfault > 0)
+		printf("swap: %d faults from disk, %d Kcycles each\n", ss.dfault, ss.dfaultkc / ss.dfault);
+	if(ksmstat(&ks) < 0){
+		fprintf(2, "kstat: ksmstat failed\n");
+		exit();
+	}
+	if(ks.passes > 0)
+		printf("ksm: %d pages saved, %d shared by %d mappings; %d merges, %d scanned in %d passes\n",
+			ks.sharing - ks.shared, ks.shared, ks.sharing, ks.merged,
+			ks.scanned, ks.passes);
+	exit();
+}
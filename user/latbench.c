@@ -0,0 +1,104 @@
+// Measure how long an interactive process waits for the CPU
+// while CPU-bound processes run.
+//
+// The parent sends a byte through a pipe to an echo process,
+// which sends it back, after a tick of think time each round,
+// as a shell would between keystrokes.  The round trip is
+// timed with no load, with spinning processes, and with the
+// spinners niced.  Usage: latbench [nspin]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user.h"
+
+#define NSPIN  4
+#define MAXSPIN 32
+#define ROUNDS 50
+
+static inline uint
+rdtsc(void)
+{
+	uint lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return lo;
+}
+
+// Time ROUNDS round trips to an echo process, and print the
+// mean and worst, in units of 1024 cycles.
+static void
+pingpong(char *what)
+{
+	int to[2], from[2], i, pid;
+	uint t, sum, max;
+	char c;
+
+	if(pipe(to) < 0 || pipe(from) < 0){
+		printf("latbench: pipe failed\n");
+		exit();
+	}
+	if((pid = fork()) < 0){
+		printf("latbench: fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		close(to[1]);
+		close(from[0]);
+		while(read(to[0], &c, 1) == 1)
+			write(from[1], &c, 1);
+		exit();
+	}
+	close(to[0]);
+	close(from[1]);
+	sum = max = 0;
+	for(i = 0; i < ROUNDS; i++){
+		sleep(1);
+		t = rdtsc();
+		if(write(to[1], "x", 1) != 1 || read(from[0], &c, 1) != 1){
+			printf("latbench: echo failed\n");
+			exit();
+		}
+		t = rdtsc() - t;
+		sum += t >> 10;
+		if(t >> 10 > max)
+			max = t >> 10;
+	}
+	close(to[1]);
+	close(from[0]);
+	wait();
+	printf("  %s  mean %d  max %d\n", what, sum / ROUNDS, max);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int pids[MAXSPIN], n, i;
+
+	n = NSPIN;
+	if(argc > 1)
+		n = atoi(argv[1]);
+	if(n < 0 || n > MAXSPIN){
+		printf("latbench: at most %d spinners\n", MAXSPIN);
+		exit();
+	}
+
+	printf("echo round trip, 1024 cycles, %d rounds, %d spinners\n", ROUNDS, n);
+	pingpong("idle   ");
+	for(i = 0; i < n; i++){
+		if((pids[i] = fork()) < 0){
+			printf("latbench: fork failed\n");
+			exit();
+		}
+		if(pids[i] == 0)
+			for(;;)
+				;
+	}
+	pingpong("loaded ");
+	for(i = 0; i < n; i++)
+		setpriority(pids[i], 19);
+	pingpong("niced  ");
+	for(i = 0; i < n; i++){
+		kill(pids[i]);
+		wait();
+	}
+	exit();
+}
@@ -54,12 +54,38 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
+int runcmd(struct cmd*, int*);
+
+// Start one side of a pipe.  A program is spawned directly;
+// anything else runs in a forked subshell that waits for its
+// own processes, so that both sides of the pipe run at once and
+// the caller waits only for the subshell.  The subshell closes
+// unused, the other end of the pipe.
+int
+runside(struct cmd *cmd, int *fd, int unused)
+{
+	int n;
+
+	if(cmd == 0 || cmd->type == EXEC)
+		return runcmd(cmd, fd);
+	if(fork1() == 0){
+		close(unused);
+		for(n = runcmd(cmd, fd); n > 0; n--)
+			wait();
+		exit();
+	}
+	return 1;
+}
 
-// Execute cmd.  Never returns.
-void
-runcmd(struct cmd *cmd)
+// Start cmd with standard input, output and error taken from
+// the shell's descriptors fd[0], fd[1] and fd[2].  Programs are
+// started with spawn(), so the shell's memory is never copied.
+// Returns the number of children to wait() for.
+int
+runcmd(struct cmd *cmd, int *fd)
 {
-	int p[2];
+	int p[2], cfd[3], n, rfd;
 	char binpath[BINPATHLEN];
 	struct backcmd *bcmd;
 	struct execcmd *ecmd;
@@ -68,7 +94,7 @@ runcmd(struct cmd *cmd)
 	struct redircmd *rcmd;
 
 	if(cmd == 0)
-		exit();
+		return 0;
 
 	switch(cmd->type){
 	default:
@@ -77,62 +103,57 @@ runcmd(struct cmd *cmd)
 	case EXEC:
 		ecmd = (struct execcmd*)cmd;
 		if(ecmd->argv[0] == 0)
-			exit();
+			return 0;
 		strcpy(binpath, "/bin/");
 		safestrcpy(binpath + 5, ecmd->argv[0], 14);
-		exec(binpath, ecmd->argv);
-		fprintf(2, "exec %s failed\n", binpath);
-		break;
+		if(spawn(binpath, ecmd->argv, fd, 3) < 0){
+			fprintf(2, "exec %s failed\n", binpath);
+			return 0;
+		}
+		return 1;
 
 	case REDIR:
 		rcmd = (struct redircmd*)cmd;
-		close(rcmd->fd);
-		if(open(rcmd->file, rcmd->mode) < 0){
+		if((rfd = open(rcmd->file, rcmd->mode)) < 0){
 			fprintf(2, "open %s failed\n", rcmd->file);
-			exit();
+			return 0;
 		}
-		runcmd(rcmd->cmd);
-		break;
+		memmove(cfd, fd, sizeof(cfd));
+		cfd[rcmd->fd] = rfd;
+		n = runcmd(rcmd->cmd, cfd);
+		close(rfd);
+		return n;
 
 	case LIST:
 		lcmd = (struct listcmd*)cmd;
-		if(fork1() == 0)
-			runcmd(lcmd->left);
-		wait();
-		runcmd(lcmd->right);
-		break;
+		for(n = runcmd(lcmd->left, fd); n > 0; n--)
+			wait();
+		return runcmd(lcmd->right, fd);
 
 	case PIPE:
 		pcmd = (struct pipecmd*)cmd;
 		if(pipe(p) < 0)
 			panic("pipe");
-		if(fork1() == 0){
-			close(1);
-			dup(p[1]);
-			close(p[0]);
-			close(p[1]);
-			runcmd(pcmd->left);
-		}
-		if(fork1() == 0){
-			close(0);
-			dup(p[0]);
-			close(p[0]);
-			close(p[1]);
-			runcmd(pcmd->right);
-		}
+		memmove(cfd, fd, sizeof(cfd));
+		cfd[1] = p[1];
+		n = runside(pcmd->left, cfd, p[0]);
+		memmove(cfd, fd, sizeof(cfd));
+		cfd[0] = p[0];
+		n += runside(pcmd->right, cfd, p[1]);
 		close(p[0]);
 		close(p[1]);
-		wait();
-		wait();
-		break;
+		return n;
 
 	case BACK:
+		// The forked child exits at once, leaving the command's
+		// processes to init, so the shell never waits for them.
 		bcmd = (struct backcmd*)cmd;
-		if(fork1() == 0)
-			runcmd(bcmd->cmd);
-		break;
+		if(fork1() == 0){
+			runcmd(bcmd->cmd, fd);
+			exit();
+		}
+		return 1;
 	}
-	exit();
 }
 
 int
@@ -150,7 +171,9 @@ int
 main(void)
 {
 	static char buf[100];
-	int fd;
+	static int stdfd[3] = { 0, 1, 2 };
+	struct cmd *cmd;
+	int fd, n;
 
 	// Ensure that three file descriptors are open.
 	while((fd = open("/dev/console", O_RDWR)) >= 0){
@@ -169,9 +192,10 @@ main(void)
 				fprintf(2, "cannot cd %s\n", buf+3);
 			continue;
 		}
-		if(fork1() == 0)
-			runcmd(parsecmd(buf));
-		wait();
+		cmd = parsecmd(buf);
+		for(n = runcmd(cmd, stdfd); n > 0; n--)
+			wait();
+		freecmd(cmd);
 	}
 	exit();
 }
@@ -494,3 +518,41 @@ nulterminate(struct cmd *cmd)
 	}
 	return cmd;
 }
+
+// Free a command returned by parsecmd.
+void
+freecmd(struct cmd *cmd)
+{
+	struct backcmd *bcmd;
+	struct listcmd *lcmd;
+	struct pipecmd *pcmd;
+	struct redircmd *rcmd;
+
+	if(cmd == 0)
+		return;
+
+	switch(cmd->type){
+	case REDIR:
+		rcmd = (struct redircmd*)cmd;
+		freecmd(rcmd->cmd);
+		break;
+
+	case PIPE:
+		pcmd = (struct pipecmd*)cmd;
+		freecmd(pcmd->left);
+		freecmd(pcmd->right);
+		break;
+
+	case LIST:
+		lcmd = (struct listcmd*)cmd;
+		freecmd(lcmd->left);
+		freecmd(lcmd->right);
+		break;
+
+	case BACK:
+		bcmd = (struct backcmd*)cmd;
+		freecmd(bcmd->cmd);
+		break;
+	}
+	free(cmd);
+}
@@ -0,0 +1,56 @@
+// Show how CPU time is shared among CPU-bound processes of
+// different nice values.
+//
+// Each child counts loop iterations in a shared-memory object
+// until the parent kills it.  Under SCHED_CFS the shares
+// follow the nice weights: a process gets about 1.25 times the
+// time of one a step nicer.  Run with CPUS=1, or the processes
+// do not compete.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user.h"
+
+#define TICKS 500
+#define KEY   0x4e49
+
+int nices[] = { 0, 0, 5, 10 };
+#define N (sizeof(nices)/sizeof(nices[0]))
+
+int
+main(void)
+{
+	volatile uint *counts;
+	int pids[N], i;
+	uint total;
+
+	if(shmget(KEY, 4096) < 0 || (counts = (uint*)shmat(KEY)) == (uint*)-1){
+		printf("sharebench: shm failed\n");
+		exit();
+	}
+	for(i = 0; i < N; i++){
+		if((pids[i] = fork()) < 0){
+			printf("sharebench: fork failed\n");
+			exit();
+		}
+		if(pids[i] == 0){
+			setpriority(0, nices[i]);
+			for(;;)
+				counts[i]++;
+		}
+	}
+	sleep(TICKS);
+	for(i = 0; i < N; i++){
+		kill(pids[i]);
+		wait();
+	}
+	total = 0;
+	for(i = 0; i < N; i++)
+		total += counts[i] / 1024;
+	printf("share of %d ticks of CPU time by nice value\n", TICKS);
+	for(i = 0; i < N; i++)
+		printf("  nice %d  %d%%\n", nices[i],
+			total ? counts[i] / 1024 * 100 / total : 0);
+	shmdt((void*)counts);
+	exit();
+}
@@ -0,0 +1,136 @@
+// Move data from a producer to a consumer process, first
+// through a pipe and then through a ring buffer in a
+// shared-memory object, and compare the time taken.
+//
+// The pipe copies each byte into and out of the kernel; the
+// ring buffer is written and read in place.  The two sides of
+// the ring spin on its counters, so run with CPUS >= 2.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user.h"
+
+#define TOTAL  (16*1024*1024)
+#define CHUNK  4096
+#define SEGSIZE (64*1024)
+#define RING   (SEGSIZE - CHUNK)  // the first page holds struct ring
+#define KEY    0x5348
+
+struct ring {
+	volatile uint head;  // bytes produced
+	volatile uint tail;  // bytes consumed
+};
+
+char chunk[CHUNK];
+
+static void
+fill(int i)
+{
+	memset(chunk, i & 0xff, CHUNK);
+}
+
+static int
+check(char *p, int i)
+{
+	return p[0] == (char)(i & 0xff) && p[CHUNK-1] == (char)(i & 0xff);
+}
+
+static int
+pipebench(void)
+{
+	int fds[2], i, n, m, pid, t;
+
+	if(pipe(fds) < 0){
+		printf("shmbench: pipe failed\n");
+		exit();
+	}
+	t = uptime();
+	if((pid = fork()) < 0){
+		printf("shmbench: fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		close(fds[1]);
+		for(i = 0; i < TOTAL/CHUNK; i++){
+			for(n = 0; n < CHUNK; n += m)
+				if((m = read(fds[0], chunk + n, CHUNK - n)) <= 0){
+					printf("shmbench: pipe read failed\n");
+					exit();
+				}
+			if(!check(chunk, i)){
+				printf("shmbench: pipe data wrong\n");
+				exit();
+			}
+		}
+		exit();
+	}
+	close(fds[0]);
+	for(i = 0; i < TOTAL/CHUNK; i++){
+		fill(i);
+		if(write(fds[1], chunk, CHUNK) != CHUNK){
+			printf("shmbench: pipe write failed\n");
+			exit();
+		}
+	}
+	close(fds[1]);
+	wait();
+	return uptime() - t;
+}
+
+static int
+shmbench(void)
+{
+	struct ring *r;
+	char *seg, *data;
+	int i, pid, t;
+
+	if(shmget(KEY, SEGSIZE) < 0 || (seg = shmat(KEY)) == (char*)-1){
+		printf("shmbench: shm failed\n");
+		exit();
+	}
+	r = (struct ring*)seg;
+	data = seg + CHUNK;
+	r->head = r->tail = 0;
+	t = uptime();
+	if((pid = fork()) < 0){
+		printf("shmbench: fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		for(i = 0; i < TOTAL/CHUNK; i++){
+			while(r->head - r->tail < CHUNK)
+				;
+			if(!check(data + r->tail % RING, i)){
+				printf("shmbench: shm data wrong\n");
+				exit();
+			}
+			__sync_synchronize();
+			r->tail += CHUNK;
+		}
+		exit();
+	}
+	for(i = 0; i < TOTAL/CHUNK; i++){
+		while(r->head - r->tail > RING - CHUNK)
+			;
+		memset(data + r->head % RING, i & 0xff, CHUNK);
+		__sync_synchronize();
+		r->head += CHUNK;
+	}
+	wait();
+	t = uptime() - t;
+	shmdt(seg);
+	return t;
+}
+
+int
+main(void)
+{
+	int tpipe, tshm;
+
+	tpipe = pipebench();
+	tshm = shmbench();
+	printf("%d KB in %d KB chunks\n", TOTAL/1024, CHUNK/1024);
+	printf("  pipe          %d ticks\n", tpipe);
+	printf("  shared memory %d ticks\n", tshm);
+	exit();
+}
@@ -0,0 +1,70 @@
+// Time system calls that touch many pages of the kernel's
+// direct map, to show the cost of kernel TLB misses.
+//
+// Shrinking the heap makes kfree() write to every freed page;
+// touching a fresh heap page zeroes one; fork() walks the page
+// tables and page reference counts of the whole address space.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user.h"
+
+#define NPAGE 2048  // 8 MB heap
+#define ROUNDS 8
+
+static inline uint
+rdtsc(void)
+{
+	uint lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return lo;
+}
+
+static char*
+touch(void)
+{
+	char *a;
+	int i;
+
+	if((a = sbrk(NPAGE*4096)) == (char*)-1){
+		printf("tlbbench: sbrk failed\n");
+		exit();
+	}
+	for(i = 0; i < NPAGE; i++)
+		a[i*4096] = 1;
+	return a;
+}
+
+int
+main(void)
+{
+	uint t, fault, shrink, forkwait;
+	int r, pid;
+
+	fault = shrink = forkwait = 0;
+	for(r = 0; r < ROUNDS; r++){
+		t = rdtsc();
+		touch();
+		fault += rdtsc() - t;
+
+		t = rdtsc();
+		if((pid = fork()) < 0){
+			printf("tlbbench: fork failed\n");
+			exit();
+		}
+		if(pid == 0)
+			exit();
+		wait();
+		forkwait += rdtsc() - t;
+
+		t = rdtsc();
+		sbrk(-NPAGE*4096);
+		shrink += rdtsc() - t;
+	}
+
+	printf("cycles per page, %d pages x %d rounds\n", NPAGE, ROUNDS);
+	printf("  demand-zero fault  %d\n", fault / (NPAGE*ROUNDS));
+	printf("  fork+exit+wait     %d\n", forkwait / (NPAGE*ROUNDS));
+	printf("  sbrk shrink        %d\n", shrink / (NPAGE*ROUNDS));
+	exit();
+}
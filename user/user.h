@@ -1,5 +1,9 @@
 struct stat;
 struct rtcdate;
+struct cpustat;
+struct memstat;
+struct swapstat;
+struct ksmstat;
 
 // system calls
 int fork(void);
@@ -23,6 +27,18 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int cpustat(struct cpustat*, int);
+int memstat(struct memstat*);
+int spawn(char*, char**, int*, int);
+char* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int shmget(int, int);
+char* shmat(int);
+int shmdt(void*);
+int swapstat(struct swapstat*);
+int madvise(void*, int, int);
+int ksmstat(struct ksmstat*);
+int setpriority(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
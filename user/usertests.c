@@ -7,6 +7,8 @@
 #include "kernel/syscall.h"
 #include "kernel/traps.h"
 #include "kernel/memlayout.h"
+#include "kernel/mmu.h"
+#include "kernel/kstat.h"
 
 char buf[8192];
 char name[3];
@@ -1411,6 +1413,564 @@ forktest(void)
 	printf("fork test OK\n");
 }
 
+// fork() shares pages copy-on-write; writes by the child,
+// including ones the kernel makes on its behalf in read(),
+// must not show up in the parent.
+void
+cowtest(void)
+{
+	int fds[2], i, pid;
+	char *a;
+	uint sz;
+
+	printf("cow test\n");
+	sz = 64*4096;
+	a = sbrk(sz);
+	if(a == (char*)0xffffffff){
+		printf("cow test sbrk failed\n");
+		exit();
+	}
+	for(i = 0; i < sz; i += 4096)
+		a[i] = 'p';
+	if(pipe(fds) != 0){
+		printf("cow test pipe failed\n");
+		exit();
+	}
+
+	pid = fork();
+	if(pid < 0){
+		printf("cow test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		for(i = 0; i < sz; i += 2*4096)
+			a[i] = 'c';
+		if(write(fds[1], "k", 1) != 1 || read(fds[0], a + 4096, 1) != 1){
+			printf("cow test pipe i/o failed\n");
+			exit();
+		}
+		for(i = 0; i < sz; i += 4096){
+			if(a[i] != (i % (2*4096) ? (i == 4096 ? 'k' : 'p') : 'c')){
+				printf("cow test child sees wrong data\n");
+				exit();
+			}
+		}
+		exit();
+	}
+	wait();
+	close(fds[0]);
+	close(fds[1]);
+
+	for(i = 0; i < sz; i += 4096){
+		if(a[i] != 'p'){
+			printf("cow test parent memory changed by child\n");
+			exit();
+		}
+	}
+	sbrk(-sz);
+	printf("cow test OK\n");
+}
+
+// spawn() starts a program with a chosen set of descriptors.
+void
+spawntest(void)
+{
+	char *argv[] = { "echo", "spawned", 0 };
+	int fds[2], cfd[3], i, n, pid;
+
+	printf("spawn test\n");
+	if(pipe(fds) != 0){
+		printf("spawn test pipe failed\n");
+		exit();
+	}
+	cfd[0] = 0;
+	cfd[1] = fds[1];
+	cfd[2] = 2;
+	pid = spawn("/bin/echo", argv, cfd, 3);
+	close(fds[1]);
+	if(pid < 0){
+		printf("spawn test spawn failed\n");
+		exit();
+	}
+	n = 0;
+	while((i = read(fds[0], buf + n, sizeof(buf) - 1 - n)) > 0)
+		n += i;
+	buf[n] = 0;
+	close(fds[0]);
+	if(wait() != pid){
+		printf("spawn test wait failed\n");
+		exit();
+	}
+	if(strcmp(buf, "spawned\n") != 0){
+		printf("spawn test wrong output\n");
+		exit();
+	}
+	if(spawn("/nonexistent", argv, 0, 0) >= 0 || spawn("/bin/echo", argv, cfd, 3) >= 0){
+		printf("spawn test bad spawn succeeded\n");
+		exit();
+	}
+	printf("spawn test OK\n");
+}
+
+// The shell runs both sides of a pipe at once, even when one
+// side is a list, so a list can write more than a pipe holds.
+void
+shpipetest(void)
+{
+	char *argv[] = { "sh", 0 };
+	char *cmd = "(cat shpipef; echo x) | wc\n";
+	int fd, cfd[3], i, n;
+	char want[13];
+
+	printf("sh pipe test\n");
+	fd = open("shpipef", O_CREATE|O_RDWR);
+	for(i = 0; i < 600; i++)
+		write(fd, "0123456789\n", 11);
+	close(fd);
+	fd = open("shpipes", O_CREATE|O_RDWR);
+	write(fd, cmd, strlen(cmd));
+	close(fd);
+	cfd[0] = open("shpipes", O_RDONLY);
+	cfd[1] = cfd[2] = open("shpipeo", O_CREATE|O_RDWR);
+	if(cfd[0] < 0 || cfd[1] < 0 || spawn("/bin/sh", argv, cfd, 3) < 0){
+		printf("sh pipe test spawn failed\n");
+		exit();
+	}
+	close(cfd[0]);
+	close(cfd[1]);
+	wait();
+	fd = open("shpipeo", O_RDONLY);
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[n < 0 ? 0 : n] = 0;
+	want[12] = 0;
+	for(i = 0; i + 12 <= n; i++)
+		if(strcmp(strncpy(want, buf + i, 12), "601 601 6602") == 0)
+			break;
+	if(i + 12 > n){
+		printf("sh pipe test wrong output: %s\n", buf);
+		exit();
+	}
+	unlink("shpipef");
+	unlink("shpipes");
+	unlink("shpipeo");
+	printf("sh pipe test OK\n");
+}
+
+// mmap() a file, and check that MAP_SHARED writes reach
+// the file on munmap() and MAP_PRIVATE ones do not.
+void
+mmaptest(void)
+{
+	int fd, i, pid;
+	char *p;
+	struct stat st;
+
+	printf("mmap test\n");
+	unlink("mmapf");
+	fd = open("mmapf", O_CREATE|O_RDWR);
+	if(fd < 0){
+		printf("mmap test create failed\n");
+		exit();
+	}
+	for(i = 0; i < 3; i++){
+		memset(buf, 'a' + i, PGSIZE);
+		if(write(fd, buf, i < 2 ? PGSIZE : 100) != (i < 2 ? PGSIZE : 100)){
+			printf("mmap test write failed\n");
+			exit();
+		}
+	}
+
+	p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == (char*)-1){
+		printf("mmap test mmap failed\n");
+		exit();
+	}
+	if(p[0] != 'a' || p[PGSIZE] != 'b' || p[2*PGSIZE+99] != 'c' || p[2*PGSIZE+100] != 0){
+		printf("mmap test wrong contents\n");
+		exit();
+	}
+	p[1] = 'X';
+	p[2*PGSIZE+200] = 'Y';  // past the end of the file
+	// The kernel can write into a mapping too.
+	if(stat("mmapf", (struct stat*)(p + PGSIZE)) < 0 || p[PGSIZE] == 'b'){
+		printf("mmap test stat into mapping failed\n");
+		exit();
+	}
+	pid = fork();
+	if(pid < 0){
+		printf("mmap test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		if(p[1] != 'X')
+			printf("mmap test child wrong contents\n");
+		exit();
+	}
+	wait();
+	if(munmap(p, 3*PGSIZE) < 0){
+		printf("mmap test munmap failed\n");
+		exit();
+	}
+	if(fstat(fd, &st) < 0 || st.size != 2*PGSIZE+100){
+		printf("mmap test file size changed\n");
+		exit();
+	}
+	close(fd);
+
+	// A private mapping of the same file sees the shared write,
+	// but its own writes are not written back.
+	fd = open("mmapf", O_RDONLY);
+	if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+		printf("mmap test writable shared mapping of read-only file\n");
+		exit();
+	}
+	p = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(p == (char*)-1 || p[0] != 'a' || p[1] != 'X'){
+		printf("mmap test private mmap failed\n");
+		exit();
+	}
+	p[0] = 'Z';
+	munmap(p, PGSIZE);
+	if(read(fd, buf, 2) != 2 || buf[0] != 'a' || buf[1] != 'X'){
+		printf("mmap test file contents wrong\n");
+		exit();
+	}
+	close(fd);
+	unlink("mmapf");
+	printf("mmap test OK\n");
+}
+
+// A MAP_SHARED mapping stays shared across fork(): parent
+// and child see each other's writes, and both reach the file.
+void
+mmapsharetest(void)
+{
+	int fd, pid, p1[2], p2[2];
+	char *p, c;
+
+	printf("mmap share test\n");
+	unlink("mmapsf");
+	fd = open("mmapsf", O_CREATE|O_RDWR);
+	memset(buf, 'a', PGSIZE);
+	if(fd < 0 || write(fd, buf, PGSIZE) != PGSIZE){
+		printf("mmap share test write failed\n");
+		exit();
+	}
+	p = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == (char*)-1 || pipe(p1) < 0 || pipe(p2) < 0){
+		printf("mmap share test mmap failed\n");
+		exit();
+	}
+	p[0] = 'P';
+	pid = fork();
+	if(pid < 0){
+		printf("mmap share test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		// The parent's write from before the fork, then one
+		// from after it.
+		if(p[0] != 'P')
+			exit();
+		p[1] = 'C';
+		write(p1[1], "x", 1);
+		if(read(p2[0], &c, 1) != 1 || p[2] != 'P')
+			exit();
+		p[3] = 'C';
+		exit();
+	}
+	if(read(p1[0], &c, 1) != 1 || p[1] != 'C'){
+		printf("mmap share test: parent missed child's write\n");
+		exit();
+	}
+	p[2] = 'P';
+	write(p2[1], "x", 1);
+	wait();
+	if(p[3] != 'C'){
+		printf("mmap share test: child missed parent's write\n");
+		exit();
+	}
+	close(p1[0]);
+	close(p1[1]);
+	close(p2[0]);
+	close(p2[1]);
+	if(munmap(p, PGSIZE) < 0 || read(fd, buf, 4) != 4 ||
+	   buf[0] != 'P' || buf[1] != 'C' || buf[2] != 'P' || buf[3] != 'C'){
+		printf("mmap share test file contents wrong\n");
+		exit();
+	}
+	close(fd);
+	unlink("mmapsf");
+	printf("mmap share test OK\n");
+}
+
+// Private mappings of a file share its pages through the
+// kernel's page cache until written, and writing the file
+// makes later mappings see the new contents.
+void
+pcachetest(void)
+{
+	struct memstat before, after;
+	char *a, *b;
+	int fd;
+
+	printf("page cache test\n");
+	unlink("pcachef");
+	fd = open("pcachef", O_CREATE|O_RDWR);
+	memset(buf, 'a', PGSIZE);
+	if(fd < 0 || write(fd, buf, PGSIZE) != PGSIZE){
+		printf("page cache test write failed\n");
+		exit();
+	}
+	a = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	b = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(a == (char*)-1 || b == (char*)-1){
+		printf("page cache test mmap failed\n");
+		exit();
+	}
+	memstat(&before);
+	if(a[0] != 'a' || b[PGSIZE-1] != 'a'){
+		printf("page cache test wrong contents\n");
+		exit();
+	}
+	memstat(&after);
+	if(after.shared < before.shared + 2*PGSIZE){
+		printf("page cache test: pages not shared\n");
+		exit();
+	}
+	b[0] = 'b';
+	if(a[0] != 'a' || b[0] != 'b' || b[1] != 'a'){
+		printf("page cache test copy-on-write failed\n");
+		exit();
+	}
+	munmap(b, PGSIZE);
+	close(fd);
+
+	fd = open("pcachef", O_RDWR);
+	memset(buf, 'c', PGSIZE);
+	if(fd < 0 || write(fd, buf, PGSIZE) != PGSIZE){
+		printf("page cache test rewrite failed\n");
+		exit();
+	}
+	b = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(b == (char*)-1 || b[0] != 'c'){
+		printf("page cache test stale page after write\n");
+		exit();
+	}
+	munmap(a, PGSIZE);
+	munmap(b, PGSIZE);
+	close(fd);
+	unlink("pcachef");
+	printf("page cache test OK\n");
+}
+
+// Shared-memory objects stay shared across fork(), and
+// can be attached by key from an unrelated mapping.
+void
+shmtest(void)
+{
+	char *a, *b;
+	int pid;
+
+	printf("shm test\n");
+	if(shmget(0x7357, 2*PGSIZE) < 0 || shmget(0x7357, 4*PGSIZE) == 0){
+		printf("shm test shmget failed\n");
+		exit();
+	}
+	if((a = shmat(0x7357)) == (char*)-1 || a[0] != 0 || a[2*PGSIZE-1] != 0){
+		printf("shm test shmat failed\n");
+		exit();
+	}
+	pid = fork();
+	if(pid < 0){
+		printf("shm test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		a[0] = 'c';
+		if((b = shmat(0x7357)) == (char*)-1 || b == a || b[0] != 'c'){
+			printf("shm test child shmat failed\n");
+			exit();
+		}
+		b[PGSIZE] = 'd';
+		shmdt(b);
+		exit();
+	}
+	wait();
+	if(a[0] != 'c' || a[PGSIZE] != 'd'){
+		printf("shm test parent does not see child's writes\n");
+		exit();
+	}
+	if(shmdt(a) < 0 || shmdt(a) == 0 || shmat(0x7357) != (char*)-1){
+		printf("shm test shmdt failed\n");
+		exit();
+	}
+	printf("shm test OK\n");
+}
+
+// Identical pages opted in with madvise() get merged by the
+// kernel's scanner, and a write to one of them unshares it.
+// The scanner leaves writable pages alone while their process
+// is in a system call, so the child spins rather than sleeps.
+void
+ksmtest(void)
+{
+	struct ksmstat before, after;
+	volatile uint spin;
+	int fds[2], i, n, pid, t;
+	char *a, c;
+
+	printf("ksm test\n");
+	n = 32;
+	if(ksmstat(&before) < 0){
+		printf("ksm test ksmstat failed\n");
+		exit();
+	}
+	if(pipe(fds) != 0){
+		printf("ksm test pipe failed\n");
+		exit();
+	}
+	pid = fork();
+	if(pid < 0){
+		printf("ksm test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		close(fds[0]);
+		if((a = sbrk((n+1)*PGSIZE)) == (char*)-1){
+			printf("ksm test sbrk failed\n");
+			exit();
+		}
+		a = (char*)PGROUNDUP((uint)a);
+		memset(a, 'k', n*PGSIZE);
+		if(madvise(a, n*PGSIZE, MADV_MERGEABLE) < 0 || madvise(a, n*PGSIZE, 99) == 0){
+			printf("ksm test madvise failed\n");
+			exit();
+		}
+		t = uptime();
+		do {
+			for(spin = 0; spin < 1000000; spin++)
+				;
+			ksmstat(&after);
+		} while(after.merged - before.merged < n - 1 && uptime() - t < 1000);
+		if(after.merged - before.merged < n - 1 || after.sharing < n){
+			printf("ksm test: %d merges, %d mappings\n",
+			       after.merged - before.merged, after.sharing);
+			exit();
+		}
+		a[0] = 'x';
+		for(i = 0; i < n*PGSIZE; i += PGSIZE){
+			if(a[i] != (i == 0 ? 'x' : 'k') || a[i+PGSIZE-1] != 'k'){
+				printf("ksm test wrong contents at page %d\n", i/PGSIZE);
+				exit();
+			}
+		}
+		if(madvise(a, n*PGSIZE, MADV_UNMERGEABLE) < 0){
+			printf("ksm test madvise failed\n");
+			exit();
+		}
+		write(fds[1], "k", 1);
+		exit();
+	}
+	close(fds[1]);
+	c = 0;
+	read(fds[0], &c, 1);
+	close(fds[0]);
+	wait();
+	if(c != 'k'){
+		printf("ksm test failed\n");
+		exit();
+	}
+	printf("ksm test OK\n");
+}
+
+// setpriority() checks its arguments, and a niced CPU-bound
+// child does not keep its parent from waking up on time.
+void
+nicetest(void)
+{
+	int pid, t;
+
+	printf("nice test\n");
+	if(setpriority(0, 5) < 0 || setpriority(0, 20) == 0 ||
+	   setpriority(0, -21) == 0 || setpriority(-1, 0) == 0){
+		printf("nice test setpriority failed\n");
+		exit();
+	}
+	pid = fork();
+	if(pid < 0){
+		printf("nice test fork failed\n");
+		exit();
+	}
+	if(pid == 0)
+		for(;;)
+			;
+	if(setpriority(pid, 19) < 0 || setpriority(0, 0) < 0){
+		printf("nice test setpriority child failed\n");
+		exit();
+	}
+	t = uptime();
+	sleep(10);
+	t = uptime() - t;
+	kill(pid);
+	wait();
+	if(t > 20){
+		printf("nice test slept %d ticks for 10\n", t);
+		exit();
+	}
+	printf("nice test OK\n");
+}
+
+// Many processes sleep at once for different numbers of ticks,
+// some longer than the 64 ticks that one level of the kernel's
+// timer wheel covers, so their timers are cascaded down to
+// level 0.  None may wake early.
+void
+sleeptest(void)
+{
+	static int ns[] = { 1, 2, 3, 5, 8, 13, 31, 63, 64, 65, 100, 127, 128, 130 };
+	int fds[2], i, n, t, ok;
+	char c;
+
+	printf("sleep test\n");
+	n = sizeof(ns)/sizeof(ns[0]);
+	if(pipe(fds) < 0){
+		printf("sleep test pipe failed\n");
+		exit();
+	}
+	for(i = 0; i < n; i++){
+		t = fork();
+		if(t < 0){
+			printf("sleep test fork failed\n");
+			exit();
+		}
+		if(t == 0){
+			close(fds[0]);
+			t = uptime();
+			sleep(ns[i]);
+			t = uptime() - t;
+			if(t < ns[i])
+				printf("sleep test slept %d ticks for %d\n", t, ns[i]);
+			write(fds[1], t < ns[i] ? "n" : "y", 1);
+			exit();
+		}
+	}
+	close(fds[1]);
+	ok = 1;
+	for(i = 0; i < n; i++)
+		if(read(fds[0], &c, 1) != 1 || c != 'y')
+			ok = 0;
+	close(fds[0]);
+	for(i = 0; i < n; i++)
+		wait();
+	if(!ok){
+		printf("sleep test failed\n");
+		exit();
+	}
+	printf("sleep test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1546,6 +2106,301 @@ sbrktest(void)
 	printf("sbrk test OK\n");
 }
 
+// sbrk() only reserves memory; pages appear when touched.
+void
+lazysbrktest(void)
+{
+	struct memstat before, after;
+	char *a, *p;
+	int fds[2], pid;
+
+	printf("lazy sbrk test\n");
+	if(memstat(&before) < 0){
+		printf("lazy sbrk test memstat failed\n");
+		exit();
+	}
+	a = sbrk(100*1024*1024);
+	if(a == (char*)0xffffffff){
+		printf("lazy sbrk test could not sbrk 100 MB\n");
+		exit();
+	}
+	p = a + 50*1024*1024;
+	*p = 'x';
+	if(*p != 'x' || a[4096] != 0 || a[100*1024*1024 - 1] != 0){
+		printf("lazy sbrk test wrong data\n");
+		exit();
+	}
+
+	// the kernel faults in pages it reads into
+	if(pipe(fds) != 0){
+		printf("lazy sbrk test pipe failed\n");
+		exit();
+	}
+	write(fds[1], "y", 1);
+	if(read(fds[0], a + 70*1024*1024, 1) != 1 || a[70*1024*1024] != 'y'){
+		printf("lazy sbrk test read into heap failed\n");
+		exit();
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	// only the four pages touched take memory
+	if(memstat(&after) < 0 || after.sz != before.sz + 100*1024*1024){
+		printf("lazy sbrk test memstat failed\n");
+		exit();
+	}
+	if(after.resident > before.resident + 4*4096){
+		printf("lazy sbrk test: %d KB resident for 4 pages touched\n",
+			(after.resident - before.resident) >> 10);
+		exit();
+	}
+
+	// untouched pages are not copied by fork
+	pid = fork();
+	if(pid < 0){
+		printf("lazy sbrk test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		if(*p != 'x' || a[8192] != 0){
+			printf("lazy sbrk test child wrong data\n");
+			exit();
+		}
+		exit();
+	}
+	wait();
+
+	if(sbrk(-100*1024*1024) == (char*)0xffffffff){
+		printf("lazy sbrk test could not shrink\n");
+		exit();
+	}
+	printf("lazy sbrk test OK\n");
+}
+
+// Fill page a with pseudo-random words that depend on seed,
+// which do not compress, or check that it still holds them.
+// Returns 0, or -1 if a check fails.
+static int
+randpage(uint *a, uint seed, int check)
+{
+	uint i, x;
+
+	x = seed * 2654435761U + 1;
+	for(i = 0; i < PGSIZE/sizeof(uint); i++){
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		if(!check)
+			a[i] = x;
+		else if(a[i] != x)
+			return -1;
+	}
+	return 0;
+}
+
+// Touch more memory than the machine has, so that pages
+// must be paged out to swap and read back.  The working set
+// is physical memory plus half the free swap, at most twice
+// physical memory, so that it fits.  The pages hold random
+// data, so that they go to the swap area on disk.
+void
+swaptest(void)
+{
+	struct swapstat before, mid, after;
+	uint i, n;
+	int fds[2], pid;
+	char *a, c;
+
+	printf("swap test\n");
+	if(swapstat(&before) < 0){
+		printf("swap test swapstat failed\n");
+		exit();
+	}
+	if(before.slots == 0){
+		printf("swap test: no swap space\n");
+		return;
+	}
+	n = before.physpages + (before.slots - before.used)/2;
+	if(n > 2*before.physpages)
+		n = 2*before.physpages;
+	if(pipe(fds) != 0){
+		printf("swap test pipe failed\n");
+		exit();
+	}
+	pid = fork();
+	if(pid < 0){
+		printf("swap test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		close(fds[0]);
+		if((a = sbrk(n*PGSIZE)) == (char*)-1){
+			printf("swap test sbrk failed\n");
+			exit();
+		}
+		for(i = 0; i < n; i++)
+			randpage((uint*)(a + i*PGSIZE), i, 0);
+		for(i = 0; i < n; i++){
+			if(randpage((uint*)(a + i*PGSIZE), i, 1) < 0){
+				printf("swap test wrong contents at page %d\n", i);
+				exit();
+			}
+		}
+		// Some pages are still in the swap area.
+		if(swapstat(&mid) < 0 || mid.used == before.used){
+			printf("swap test: no swap slots in use\n");
+			exit();
+		}
+		write(fds[1], "k", 1);
+		exit();
+	}
+	close(fds[1]);
+	c = 0;
+	read(fds[0], &c, 1);
+	close(fds[0]);
+	wait();
+	if(c != 'k'){
+		printf("swap test failed\n");
+		exit();
+	}
+	swapstat(&after);
+	// Random pages do not compress, so they went to disk.
+	if(after.pageout == before.pageout || after.pagein == before.pagein ||
+	   after.dfault == before.dfault || after.used != before.used){
+		printf("swap test: pageout %d pagein %d dfault %d used %d\n",
+		       after.pageout - before.pageout, after.pagein - before.pagein,
+		       after.dfault - before.dfault, after.used);
+		exit();
+	}
+	printf("swap test OK\n");
+}
+
+// Touch more memory than the machine has with pages that are
+// nearly all zeroes, which the compressed store should keep.
+// The excess is ZRAMPAGES pages, well within the store.
+void
+zramtest(void)
+{
+	struct swapstat before, after;
+	uint i, n;
+	int fds[2], pid;
+	char *a, c;
+
+	printf("zram test\n");
+	if(swapstat(&before) < 0){
+		printf("zram test swapstat failed\n");
+		exit();
+	}
+	n = before.physpages + ZRAMPAGES;
+	if(pipe(fds) != 0){
+		printf("zram test pipe failed\n");
+		exit();
+	}
+	pid = fork();
+	if(pid < 0){
+		printf("zram test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		close(fds[0]);
+		if((a = sbrk(n*PGSIZE)) == (char*)-1){
+			printf("zram test sbrk failed\n");
+			exit();
+		}
+		for(i = 0; i < n; i++)
+			*(uint*)(a + i*PGSIZE) = i;
+		for(i = 0; i < n; i++){
+			if(*(uint*)(a + i*PGSIZE) != i){
+				printf("zram test wrong contents at page %d\n", i);
+				exit();
+			}
+		}
+		write(fds[1], "k", 1);
+		exit();
+	}
+	close(fds[1]);
+	c = 0;
+	read(fds[0], &c, 1);
+	close(fds[0]);
+	wait();
+	if(c != 'k'){
+		printf("zram test failed\n");
+		exit();
+	}
+	swapstat(&after);
+	if(after.zfault == before.zfault){
+		printf("zram test: no faults served from the store\n");
+		exit();
+	}
+	printf("zram test OK\n");
+}
+
+// Large aligned stretches of heap are moved into 4 MB pages
+// once they fill up; partial sbrk shrinks and fork must split
+// them.
+void
+hugepagetest(void)
+{
+	struct memstat st, st1;
+	char *a, *b;
+	uint i;
+	int pid;
+
+	printf("huge page test\n");
+	a = sbrk(0);
+	b = sbrk((16*1024*1024 - (uint)a % (4*1024*1024)));
+	if(b != a){
+		printf("huge page test sbrk failed\n");
+		exit();
+	}
+	a = sbrk(0) - 12*1024*1024;
+	for(i = 0; i < 12*1024*1024; i += 4096)
+		a[i] = i >> 12;
+	if(memstat(&st) < 0){
+		printf("huge page test memstat failed\n");
+		exit();
+	}
+	if(st.huge < 12*1024*1024){
+		printf("huge page test: %d of %d KB resident in 4 MB pages\n",
+			st.huge >> 10, st.resident >> 10);
+		exit();
+	}
+
+	// shrink into the middle of the second 4 MB page, which
+	// is split, and free the third
+	sbrk(-(6*1024*1024));
+	if(memstat(&st1) < 0 || st1.huge != st.huge - 8*1024*1024 ||
+	   st1.hugesplit != st.hugesplit + 1){
+		printf("huge page test: shrink left %d KB in 4 MB pages\n", st1.huge >> 10);
+		exit();
+	}
+	sbrk(4096);
+	if(a[6*1024*1024] != 0 || a[6*1024*1024 - 4096] != (char)((6*1024*1024 - 4096) >> 12)){
+		printf("huge page test wrong data after shrink\n");
+		exit();
+	}
+
+	pid = fork();
+	if(pid < 0){
+		printf("huge page test fork failed\n");
+		exit();
+	}
+	if(pid == 0){
+		for(i = 0; i < 6*1024*1024; i += 4096)
+			a[i] = 0;
+		exit();
+	}
+	wait();
+	for(i = 0; i < 6*1024*1024; i += 4096){
+		if(a[i] != (char)(i >> 12)){
+			printf("huge page test wrong data after fork\n");
+			exit();
+		}
+	}
+	sbrk(-(uint)(sbrk(0) - b));
+	printf("huge page test OK\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,6 +2623,10 @@ main(int argc, char *argv[])
 	bigargtest();
 	bsstest();
 	sbrktest();
+	lazysbrktest();
+	hugepagetest();
+	swaptest();
+	zramtest();
 	validatetest();
 
 	opentest();
@@ -1793,6 +2652,16 @@ main(int argc, char *argv[])
 	dirfile();
 	iref();
 	forktest();
+	cowtest();
+	spawntest();
+	shpipetest();
+	mmaptest();
+	mmapsharetest();
+	pcachetest();
+	shmtest();
+	ksmtest();
+	nicetest();
+	sleeptest();
 	bigdir(); // slow
 
 	uio();